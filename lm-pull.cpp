@@ -1,24 +1,64 @@
 #if defined(_WIN32)
 #include <windows.h>
 #else
+#include <fcntl.h>
+#include <netdb.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #endif
 
+#if defined(__linux__)
+#include <linux/fs.h>
+#if __has_include(<linux/io_uring.h>)
+#define LM_PULL_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
 #include <curl/curl.h>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <cstdarg>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <ctime>
+#include <deque>
 #include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iomanip>
+#include <iterator>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include "nlohmann/json.hpp"
 
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define LM_PULL_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 #if defined(_WIN32)
 #define FORMAT_ATTR(fmt, args)
 #else
@@ -59,6 +99,67 @@ struct progress_data {
   bool printed = false;
 };
 
+struct pull_options {
+    std::string store;                // root of the blob store, the cache directory unless --store is given
+    int         connections = 1;      // parallel range requests per file
+    long        conn_budget = 32;     // connections open at once across every pull, 0 for no limit
+    bool        progress    = true;   // draw progress bars, off when several models are pulled at once
+    bool        tls_cache   = false;  // keep TLS session tickets across invocations
+    bool        bench       = false;  // run the SHA-256 microbenchmark instead of pulling
+    bool        stats       = false;  // print transfer statistics after each download
+    bool        io_uring    = false;  // write through io_uring instead of pwritev where the kernel allows
+    bool        bench_write = false;  // compare the disk write paths instead of pulling
+    bool        direct      = false;  // keep downloads out of the page cache (O_DIRECT, drop-behind otherwise)
+    bool        durable     = true;   // sync a download before and after renaming it into place
+    int         retries     = 5;      // attempts after the first for a failed transfer
+    int         retry_time  = 600;    // seconds a download keeps retrying without receiving any bytes
+    long        speed_limit = 16384;  // bytes per second under which a flow counts as stalled, 0 disables
+    long        speed_time  = 30;     // seconds a flow may stay under speed_limit before it is replaced
+    bool        hedge       = true;   // duplicate metadata requests that are slower than usual
+    bool        preconnect  = true;   // connect to the registry and its CDN hosts while the token is fetched
+    bool        offline     = false;  // resolve manifests and files from the cache only, with no network access
+
+    std::vector<std::string> include;  // globs selecting the files of a whole hf:// repository, all of them when empty
+    std::vector<std::string> exclude;  // globs of repository files to leave out
+};
+
+static pull_options options;
+
+// Counters summed over every transfer of the run, reported before exit
+struct pull_totals {
+    std::atomic<int>        retries{ 0 };
+    std::atomic<curl_off_t> resumed{ 0 };     // bytes retries did not have to fetch again
+    std::atomic<int>        hedged{ 0 };      // metadata requests that were sent a second time
+    std::atomic<int>        hedge_wins{ 0 };  // of those, how often the second copy answered first
+};
+
+static pull_totals totals;
+
+class DigestStream;
+
+// One byte range of a segmented download
+struct segment {
+    curl_off_t              start = 0;  // first byte of the range
+    curl_off_t              end   = 0;  // one past the last byte of the range
+    std::atomic<curl_off_t> done{ 0 };  // bytes of the range already on disk
+};
+
+// Shared by every connection of a segmented download; persisted next to the .partial so it can be resumed
+struct segmented_state {
+    std::string                           path;         // sidecar holding the segment table
+    curl_off_t                            size    = 0;  // total size of the remote object
+    curl_off_t                            resumed = 0;  // bytes already on disk when this run started
+    std::vector<segment>                  segments;
+    std::mutex                            mutex;
+    std::chrono::steady_clock::time_point last_save;
+    progress_data                         progress;
+    bool                                  show_progress = false;
+    DigestStream *                        digest        = nullptr;
+    std::string                           etag;           // validators of the remote object, compared on resume
+    std::string                           last_modified;
+    std::string                           source;         // origin the validators came from
+};
+
 // Function to get the basename of a path
 static std::string basename(const std::string& path) {
   const size_t pos = path.find_last_of("/\\");
@@ -73,6 +174,13 @@ static bool starts_with(const std::string& str, const std::string& prefix) {
   return str.rfind(prefix, 0) == 0;
 }
 
+// scheme://host[:port] of a URL, without the path
+static std::string url_origin(const std::string & url) {
+    const size_t scheme = url.find("://");
+    const size_t path   = url.find('/', scheme == std::string::npos ? 0 : scheme + 3);
+    return url.substr(0, path);
+}
+
 static int rm_substring(std::string& model_, const std::string& substring) {
     const std::string::size_type pos = model_.find(substring);
     if (pos == std::string::npos) {
@@ -83,6 +191,93 @@ static int rm_substring(std::string& model_, const std::string& substring) {
     return 0;
 }
 
+// Per-user directory for state that outlives one invocation
+static std::string cache_dir() {
+    const char * xdg = getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg) {
+        return std::string(xdg) + "/lm-pull";
+    }
+
+#if defined(_WIN32)
+    const char * local = getenv("LOCALAPPDATA");
+    if (local && *local) {
+        return std::string(local) + "\\lm-pull";
+    }
+#endif
+    const char * home = getenv("HOME");
+
+    return std::string(home ? home : ".") + "/.cache/lm-pull";
+}
+
+// JSON state kept between runs: metadata, latencies, redirects, tokens and download sidecars. A file that is missing
+// or does not parse reads as an empty object.
+static nlohmann::json read_json(const std::string & path) {
+    try {
+        std::ifstream in(path);
+        return nlohmann::json::parse(in);
+    } catch (const std::exception &) {
+        return nlohmann::json::object();
+    }
+}
+
+// Replace a file atomically, so a crash leaves either the old or the new contents. mode is the file's permission bits:
+// the temporary file is created with them, so a private (0600) file is never readable by others, not even briefly, and
+// O_NOFOLLOW keeps a symlink planted at the temporary name from redirecting the write. Missing directories are
+// created 0700, as the XDG base directory spec asks, so the tokens directory is private too.
+static int write_file_atomic(const std::string & path, const std::string & data, int mode = 0644) {
+    const std::string           tmp = path + ".tmp";
+    const std::filesystem::path dir = std::filesystem::path(path).parent_path();
+    std::error_code             ec;
+#if defined(_WIN32)
+    std::filesystem::create_directories(dir, ec);
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out << data;
+        if (!out) {
+            return 1;
+        }
+    }
+#else
+    std::filesystem::path prefix;
+    for (const auto & part : dir) {
+        prefix /= part;
+        ::mkdir(prefix.c_str(), 0700);
+    }
+
+    const int fd = ::open(tmp.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC | O_NOFOLLOW, mode);
+    if (fd < 0) {
+        return 1;
+    }
+
+    size_t written = 0;
+    while (written < data.size()) {
+        const ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            break;
+        }
+
+        written += n;
+    }
+
+    if (::close(fd) != 0 || written < data.size()) {
+        unlink(tmp.c_str());
+        return 1;
+    }
+#endif
+
+    std::filesystem::rename(tmp, path, ec);
+
+    return ec ? 1 : 0;
+}
+
+static int write_json(const std::string & path, const nlohmann::json & json, int mode = 0644) {
+    return write_file_atomic(path, json.dump(), mode);
+}
+
 static int get_terminal_width() {
 #if defined(_WIN32)
   CONSOLE_SCREEN_BUFFER_INFO csbi;
@@ -105,6 +300,181 @@ class File {
         return file;
     }
 
+    // Open for positional writes, creating the file if needed (no O_APPEND). uncached keeps the data out of the page
+    // cache: block-aligned writes go through a second O_DIRECT descriptor, the rest is written back and dropped.
+    FILE * open_rw(const std::string & filename, bool uncached = false) {
+#ifdef _WIN32
+        file = fopen(filename.c_str(), "ab");
+        if (file) {
+            fclose(file);
+            file = fopen(filename.c_str(), "r+b");
+        }
+#else
+        const int rw_fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (rw_fd >= 0) {
+            file = fdopen(rw_fd, "r+b");
+            if (!file) {
+                ::close(rw_fd);
+            }
+        }
+#endif
+#if defined(__linux__)
+        if (file && uncached) {
+            // tmpfs and some network filesystems refuse O_DIRECT, every write then takes the drop-behind path
+            direct_fd = ::open(filename.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+        }
+#endif
+        this->uncached = uncached;
+
+        return file;
+    }
+
+    bool direct() const { return direct_fd >= 0; }
+
+    int resize(curl_off_t size) {
+#ifdef _WIN32
+        return _chsize_s(_fileno(file), size) != 0;
+#else
+        return ftruncate(fileno(file), size) != 0;
+#endif
+    }
+
+    // Write the whole buffer at offset, safe to call from several threads
+    int pwrite(const void * ptr, size_t size, curl_off_t offset) {
+        const char * p = static_cast<const char *>(ptr);
+        while (size > 0) {
+#ifdef _WIN32
+            OVERLAPPED overlapped = {};
+            overlapped.Offset     = static_cast<DWORD>(offset);
+            overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+            DWORD written         = 0;
+            if (!WriteFile((HANDLE) _get_osfhandle(_fileno(file)), p, static_cast<DWORD>(std::min<size_t>(size, 1 << 30)),
+                           &written, &overlapped)) {
+                return 1;
+            }
+#else
+            const ssize_t written = ::pwrite(fileno(file), p, size, offset);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                return 1;
+            }
+#endif
+            p += written;
+            size -= written;
+            offset += written;
+        }
+
+        return 0;
+    }
+
+    // Reserve extents for the first size bytes so the file is laid out contiguously and a full disk shows up now
+    // rather than hours into the transfer. keep_size leaves the file length alone, for appending resumes. Returns 1
+    // only when the space is not there; filesystems without fallocate simply go without the reservation.
+    int preallocate(curl_off_t size, bool keep_size) {
+#if defined(__linux__)
+        while (fallocate(fileno(file), keep_size ? FALLOC_FL_KEEP_SIZE : 0, 0, size) != 0) {
+            if (errno != EINTR) {
+                return errno == ENOSPC || errno == EDQUOT || errno == EFBIG;
+            }
+        }
+#else
+        (void) size;
+        (void) keep_size;
+#endif
+
+        return 0;
+    }
+
+    // The descriptor a write of [offset, offset + size) goes through: O_DIRECT when both ends are block aligned
+    int descriptor(curl_off_t offset = 0, size_t size = 0) const {
+        return direct_fd >= 0 && offset % direct_alignment == 0 && size % direct_alignment == 0 ? direct_fd :
+                                                                                                 fileno(file);
+    }
+
+    // Called once a range is written; in uncached mode a range that went through the page cache is pushed to disk
+    // and dropped so it does not evict anything else, otherwise it joins the writeback window
+    void written(curl_off_t offset, size_t size) {
+        if (descriptor(offset, size) == direct_fd) {
+            return;
+        }
+
+        if (uncached) {
+            drop_cache(offset, size);
+        } else {
+            write_behind(offset, size);
+        }
+    }
+
+    // Write consecutive buffers as one contiguous range starting at offset
+    int pwritev(const std::vector<std::pair<const char *, size_t>> & parts, curl_off_t offset) {
+        size_t total = 0;
+        for (const auto & part : parts) {
+            total += part.second;
+        }
+
+        // Only the final buffer of a stream can end unaligned, its tail goes through the page cache
+        const size_t aligned = direct_fd >= 0 && offset % direct_alignment == 0 ? total / direct_alignment *
+                                                                                      direct_alignment :
+                                                                                  0;
+        std::vector<std::pair<const char *, size_t>> head, tail;
+        size_t                                       seen = 0;
+        for (const auto & part : parts) {
+            const size_t split = std::clamp(aligned - std::min(aligned, seen), size_t(0), part.second);
+            if (split > 0) {
+                head.emplace_back(part.first, split);
+            }
+
+            if (split < part.second) {
+                tail.emplace_back(part.first + split, part.second - split);
+            }
+
+            seen += part.second;
+        }
+
+        if ((!head.empty() && write_parts(direct_fd, head, offset)) ||
+            (!tail.empty() && write_parts(fileno(file), tail, offset + aligned))) {
+            return 1;
+        }
+
+        written(offset + aligned, total - aligned);
+
+        return 0;
+    }
+
+    // Bytes of the file currently held in the page cache, or -1 where that cannot be asked
+    curl_off_t cached_bytes() const {
+#if defined(__linux__)
+        struct stat st;
+        if (fstat(fileno(file), &st) != 0 || st.st_size == 0) {
+            return 0;
+        }
+
+        void * map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fileno(file), 0);
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+
+        const long                 page = sysconf(_SC_PAGESIZE);
+        std::vector<unsigned char> resident((st.st_size + page - 1) / page);
+        curl_off_t                 cached = -1;
+        if (mincore(map, st.st_size, resident.data()) == 0) {
+            cached = 0;
+            for (const unsigned char pages : resident) {
+                cached += (pages & 1) * page;
+            }
+        }
+
+        munmap(map, st.st_size);
+
+        return cached;
+#else
+        return -1;
+#endif
+    }
+
     int lock() {
         if (file) {
 #ifdef _WIN32
@@ -148,267 +518,4614 @@ class File {
 #endif
         }
 
+        if (direct_fd >= 0) {
+            ::close(direct_fd);
+        }
+
         if (file) {
             fclose(file);
         }
     }
 
+    static constexpr curl_off_t direct_alignment = 4096;
+    static constexpr curl_off_t writeback_window = 16 << 20;
+
   private:
-    int fd = -1;
-#ifdef _WIN32
-    HANDLE hFile = nullptr;
+    int  fd        = -1;
+    int  direct_fd = -1;
+    bool uncached  = false;
+
+    using range = std::pair<curl_off_t, curl_off_t>;  // offset, size
+    std::vector<range> dirty;            // written since writeback was last started
+    std::deque<range>  flushing;         // writeback started, oldest first
+    curl_off_t         dirty_bytes    = 0;
+    curl_off_t         flushing_bytes = 0;
+
+    // Start writeback every window instead of letting the kernel collect gigabytes of dirty pages and then stall the
+    // writer on all of them at once; waiting on the oldest window keeps dirty memory at a few windows
+    void write_behind(curl_off_t offset, size_t size) {
+#if defined(__linux__)
+        if (!dirty.empty() && dirty.back().first + dirty.back().second == offset) {
+            dirty.back().second += size;
+        } else {
+            dirty.emplace_back(offset, size);
+        }
+
+        dirty_bytes += size;
+        if (dirty_bytes < writeback_window) {
+            return;
+        }
+
+        for (const range & r : dirty) {
+            sync_file_range(fileno(file), r.first, r.second, SYNC_FILE_RANGE_WRITE);
+            flushing.push_back(r);
+            flushing_bytes += r.second;
+        }
+
+        dirty.clear();
+        dirty_bytes = 0;
+        while (flushing_bytes > 2 * writeback_window) {
+            const range r = flushing.front();
+            sync_file_range(fileno(file), r.first, r.second,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            flushing.pop_front();
+            flushing_bytes -= r.second;
+        }
+#else
+        (void) offset;
+        (void) size;
 #endif
-};
+    }
 
-class HttpClient {
-  public:
-    int init(const std::string & url, const std::vector<std::string> & headers, const std::string & output_file,
-             const bool progress, std::string * response_str = nullptr) {
-        std::string output_file_partial;
-        curl = curl_easy_init();
-        if (!curl) {
-            return 1;
+    // Start writeback of the range, wait for it, then evict the now clean pages
+    void drop_cache(curl_off_t offset, size_t size) {
+#if defined(__linux__)
+        if (size > 0) {
+            sync_file_range(fileno(file), offset, size,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(fileno(file), offset, size, POSIX_FADV_DONTNEED);
+        }
+#else
+        (void) offset;
+        (void) size;
+#endif
+    }
+
+#ifndef _WIN32
+    static int write_parts(int fd, const std::vector<std::pair<const char *, size_t>> & parts, curl_off_t offset) {
+        std::vector<iovec> iov;
+        for (const auto & part : parts) {
+            iov.push_back({ const_cast<char *>(part.first), part.second });
         }
 
-        progress_data data;
-        File          out;
-        if (!output_file.empty()) {
-            output_file_partial = output_file + ".partial";
-            if (!out.open(output_file_partial, "ab")) {
-                printe("Failed to open file\n");
+        for (size_t i = 0; i < iov.size();) {
+            const ssize_t written = ::pwritev(fd, &iov[i], std::min<size_t>(iov.size() - i, IOV_MAX), offset);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
 
                 return 1;
             }
 
-            if (out.lock()) {
-                printe("Failed to exclusively lock file\n");
+            offset += written;
+            for (size_t left = written; left > 0;) {
+                const size_t n = std::min(left, iov[i].iov_len);
+                iov[i].iov_base = static_cast<char *>(iov[i].iov_base) + n;
+                iov[i].iov_len -= n;
+                left -= n;
+                if (iov[i].iov_len == 0) {
+                    ++i;
+                }
+            }
+        }
 
+        return 0;
+    }
+#else
+    int write_parts(int, const std::vector<std::pair<const char *, size_t>> & parts, curl_off_t offset) {
+        for (const auto & part : parts) {
+            if (pwrite(part.first, part.second, offset)) {
                 return 1;
             }
-        }
 
-        set_write_options(response_str, out);
-        data.file_size = set_resume_point(output_file_partial);
-        set_progress_options(progress, data);
-        set_headers(headers);
-        perform(url);
-        if (!output_file.empty()) {
-            std::filesystem::rename(output_file_partial, output_file);
+            offset += part.second;
         }
 
         return 0;
     }
+#endif
+#ifdef _WIN32
+    HANDLE hFile = nullptr;
+#endif
+};
 
-    ~HttpClient() {
-        if (chunk) {
-            curl_slist_free_all(chunk);
-        }
+// Flush a file or directory to stable storage; directories only on POSIX, where their fsync makes renames durable
+static int sync_path(const std::string & path, bool directory) {
+#ifdef _WIN32
+    (void) path;
+    (void) directory;
 
-        if (curl) {
-            curl_easy_cleanup(curl);
-        }
+    return 0;
+#else
+    const int fd = ::open(path.c_str(), (directory ? O_DIRECTORY : 0) | O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 1;
     }
 
-  private:
-    CURL *              curl  = nullptr;
-    struct curl_slist * chunk = nullptr;
+    const int ret = directory ? fsync(fd) : fdatasync(fd);
+    ::close(fd);
 
-    void set_write_options(std::string * response_str, const File & out) {
-        if (response_str) {
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, capture_data);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, response_str);
-        } else {
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, out.file);
-        }
+    return ret != 0;
+#endif
+}
+
+// Move a finished file to its final name. With the durable policy the data is on disk before the rename and the
+// rename is on disk before we return, so a crash leaves either the old name or a complete file under the new one.
+static int commit_file(const std::string & from, const std::string & to) {
+    if (options.durable && sync_path(from, false)) {
+        printe("Failed to sync %s: %s\n", from.c_str(), strerror(errno));
+
+        return 1;
     }
 
-    size_t set_resume_point(const std::string & output_file) {
-        size_t file_size = 0;
-        if (std::filesystem::exists(output_file)) {
-            file_size = std::filesystem::file_size(output_file);
-            curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, static_cast<curl_off_t>(file_size));
-        }
+    std::error_code ec;
+    std::filesystem::rename(from, to, ec);
+    if (ec) {
+        printe("Failed to rename %s to %s: %s\n", from.c_str(), to.c_str(), ec.message().c_str());
 
-        return file_size;
+        return 1;
     }
 
-    void set_progress_options(bool progress, progress_data & data) {
-        if (progress) {
-            curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
-            curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &data);
-            curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, update_progress);
+    if (options.durable) {
+        const std::filesystem::path parent = std::filesystem::absolute(to, ec).parent_path();
+        if (sync_path(parent.string(), true)) {
+            printe("Failed to sync %s: %s\n", parent.string().c_str(), strerror(errno));
+
+            return 1;
         }
     }
 
-    void set_headers(const std::vector<std::string> & headers) {
-        if (!headers.empty()) {
-            if (chunk) {
-                curl_slist_free_all(chunk);
-                chunk = 0;
-            }
-
-            for (const auto & header : headers) {
-                chunk = curl_slist_append(chunk, header.c_str());
-            }
+    return 0;
+}
 
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, chunk);
+#if defined(LM_PULL_IO_URING)
+// Just enough io_uring over the raw syscalls to queue writes from registered buffers and reap their completions;
+// only the writer thread that owns it may touch it
+class IoUring {
+  public:
+    ~IoUring() {
+        if (sqes) {
+            munmap(sqes, sqes_size);
         }
-    }
 
-    void perform(const std::string & url) {
-        CURLcode res;
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-        curl_easy_setopt(curl, CURLOPT_DEFAULT_PROTOCOL, "https");
-        curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
-        res = curl_easy_perform(curl);
-        if (res != CURLE_OK) {
-            printe("curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+        if (cq_ptr && cq_ptr != sq_ptr) {
+            munmap(cq_ptr, cq_size);
         }
-    }
 
-    static std::string human_readable_time(double seconds) {
-        int hrs  = static_cast<int>(seconds) / 3600;
-        int mins = (static_cast<int>(seconds) % 3600) / 60;
-        int secs = static_cast<int>(seconds) % 60;
+        if (sq_ptr) {
+            munmap(sq_ptr, sq_size);
+        }
 
-        if (hrs > 0) {
-            return fmt("%dh %02dm %02ds", hrs, mins, secs);
-        } else if (mins > 0) {
-            return fmt("%dm %02ds", mins, secs);
-        } else {
-            return fmt("%ds", secs);
+        if (ring_fd >= 0) {
+            ::close(ring_fd);
         }
     }
 
-    static std::string human_readable_size(curl_off_t size) {
-        static const char * suffix[] = { "B", "KB", "MB", "GB", "TB" };
-        char                length   = sizeof(suffix) / sizeof(suffix[0]);
-        int                 i        = 0;
-        double              dbl_size = size;
-        if (size > 1024) {
-            for (i = 0; (size / 1024) > 0 && i < length - 1; i++, size /= 1024) {
-                dbl_size = size / 1024.0;
-            }
+    int init(unsigned entries) {
+        io_uring_params params = {};
+        ring_fd                = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0) {
+            return 1;
+        }
+
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        }
+
+        sq_ptr = map(sq_size, IORING_OFF_SQ_RING);
+        cq_ptr = params.features & IORING_FEAT_SINGLE_MMAP ? sq_ptr : map(cq_size, IORING_OFF_CQ_RING);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes      = static_cast<io_uring_sqe *>(map(sqes_size, IORING_OFF_SQES));
+        if (!sq_ptr || !cq_ptr || !sqes) {
+            return 1;
+        }
+
+        char * sq = static_cast<char *>(sq_ptr);
+        char * cq = static_cast<char *>(cq_ptr);
+        sq_tail   = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sq_mask   = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sq_array  = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        cq_head   = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cq_tail   = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cq_mask   = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes      = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        capacity  = params.sq_entries;
+
+        return 0;
+    }
+
+    // Pin the buffers once so writes from them skip the per-request page mapping; returns 1 if the kernel refuses
+    int register_buffers(const std::vector<iovec> & iov) {
+        return syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iov.data(), iov.size()) != 0;
+    }
+
+    unsigned entries() const { return capacity; }
+
+    // Whether the kernel knows opcode op. IORING_OP_WRITE came in 5.6, after the ring itself, so a ring that sets up
+    // can still fail every write with -EINVAL; kernels before 5.6 have no probe either and report false.
+    bool supports(uint8_t op) const {
+        std::vector<char> storage(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+        auto *            probe = reinterpret_cast<io_uring_probe *>(storage.data());
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) != 0) {
+            return false;
+        }
+
+        return op < probe->ops_len && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    // Queue a write; buf_index names a registered buffer holding data, or is -1 for an ordinary one
+    void write(int fd, const void * data, size_t size, curl_off_t offset, int buf_index, uint64_t user_data) {
+        const unsigned tail = *sq_tail;
+        io_uring_sqe & sqe  = sqes[tail & sq_mask];
+        sqe                 = {};
+        sqe.opcode          = buf_index >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe.fd              = fd;
+        sqe.off             = offset;
+        sqe.addr            = reinterpret_cast<uint64_t>(data);
+        sqe.len             = size;
+        sqe.buf_index       = buf_index >= 0 ? buf_index : 0;
+        sqe.user_data       = user_data;
+        sq_array[tail & sq_mask] = tail & sq_mask;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ++unsubmitted;
+    }
+
+    // Hand every queued write to the kernel in one call, waiting for at least wait completions
+    int submit(unsigned wait) {
+        while (syscall(__NR_io_uring_enter, ring_fd, unsubmitted, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr,
+                       0) < 0) {
+            if (errno != EINTR) {
+                return 1;
+            }
+        }
+
+        unsubmitted = 0;
+
+        return 0;
+    }
+
+    // Call done(user_data, res) for every completion that has arrived
+    template <typename F> void reap(F done) {
+        unsigned       head = *cq_head;
+        const unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            const io_uring_cqe & cqe = cqes[head & cq_mask];
+            done(cqe.user_data, cqe.res);
+        }
+
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+
+  private:
+    int            ring_fd     = -1;
+    void *         sq_ptr      = nullptr;
+    void *         cq_ptr      = nullptr;
+    size_t         sq_size     = 0;
+    size_t         cq_size     = 0;
+    size_t         sqes_size   = 0;
+    io_uring_sqe * sqes        = nullptr;
+    io_uring_cqe * cqes        = nullptr;
+    unsigned *     sq_tail     = nullptr;
+    unsigned *     sq_array    = nullptr;
+    unsigned *     cq_head     = nullptr;
+    unsigned *     cq_tail     = nullptr;
+    unsigned       sq_mask     = 0;
+    unsigned       cq_mask     = 0;
+    unsigned       capacity    = 0;
+    unsigned       unsubmitted = 0;
+
+    void * map(size_t size, off_t offset) {
+        void * ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+        return ptr == MAP_FAILED ? nullptr : ptr;
+    }
+};
+#endif
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotr32(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_compress_portable(uint32_t * state, const uint8_t * blocks, size_t count) {
+    for (; count > 0; --count, blocks += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t) blocks[i * 4] << 24 | (uint32_t) blocks[i * 4 + 1] << 16 |
+                   (uint32_t) blocks[i * 4 + 2] << 8 | blocks[i * 4 + 3];
+        }
+
+        for (int i = 16; i < 64; ++i) {
+            const uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i]              = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            const uint32_t t1 =
+                h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            const uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h                 = g;
+            g                 = f;
+            f                 = e;
+            e                 = d + t1;
+            d                 = c;
+            c                 = b;
+            b                 = a;
+            a                 = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(LM_PULL_X86)
+// SHA extensions: two rounds per sha256rnds2, message schedule in sha256msg1/msg2
+__attribute__((target("sha,sse4.1"))) static void sha256_compress_shani(uint32_t * state, const uint8_t * blocks,
+                                                                        size_t count) {
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i       tmp   = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[0]), 0xB1);  // CDAB
+    __m128i       st1   = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[4]), 0x1B);  // EFGH
+    __m128i       st0   = _mm_alignr_epi8(tmp, st1, 8);                                            // ABEF
+    st1                 = _mm_blend_epi16(st1, tmp, 0xF0);                                         // CDGH
+
+    for (; count > 0; --count, blocks += 64) {
+        const __m128i abef = st0;
+        const __m128i cdgh = st1;
+        __m128i       msg[4];
+#pragma GCC unroll 16
+        for (int g = 0; g < 16; ++g) {
+            __m128i & cur  = msg[g & 3];
+            __m128i & next = msg[(g + 1) & 3];
+            __m128i & prev = msg[(g + 3) & 3];
+            if (g < 4) {
+                cur = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (blocks + 16 * g)), bswap);
+            }
+
+            __m128i wk = _mm_add_epi32(cur, _mm_loadu_si128((const __m128i *) &sha256_k[4 * g]));
+            st1        = _mm_sha256rnds2_epu32(st1, st0, wk);
+            if (g >= 3 && g < 15) {
+                next = _mm_sha256msg2_epu32(_mm_add_epi32(next, _mm_alignr_epi8(cur, prev, 4)), cur);
+            }
+
+            wk  = _mm_shuffle_epi32(wk, 0x0E);
+            st0 = _mm_sha256rnds2_epu32(st0, st1, wk);
+            if (g >= 1 && g < 13) {
+                prev = _mm_sha256msg1_epu32(prev, cur);
+            }
+        }
+
+        st0 = _mm_add_epi32(st0, abef);
+        st1 = _mm_add_epi32(st1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(st0, 0x1B);                                           // FEBA
+    st1 = _mm_shuffle_epi32(st1, 0xB1);                                           // DCHG
+    _mm_storeu_si128((__m128i *) &state[0], _mm_blend_epi16(tmp, st1, 0xF0));  // DCBA
+    _mm_storeu_si128((__m128i *) &state[4], _mm_alignr_epi8(st1, tmp, 8));     // HGFE
+}
+
+__attribute__((target("avx2"))) static inline __m256i ror256(__m256i x, int n) {
+    return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+__attribute__((target("avx2"))) static inline __m256i sigma0_256(__m256i x) {
+    return _mm256_xor_si256(_mm256_xor_si256(ror256(x, 7), ror256(x, 18)), _mm256_srli_epi32(x, 3));
+}
+
+__attribute__((target("avx2"))) static inline __m256i sigma1_256(__m256i x) {
+    return _mm256_xor_si256(_mm256_xor_si256(ror256(x, 17), ror256(x, 19)), _mm256_srli_epi32(x, 10));
+}
+
+// Message schedule of two blocks at once, one per 128-bit lane, then scalar rounds where BMI2 turns the rotates
+// into rorx
+__attribute__((target("avx2,bmi2"))) static void sha256_compress_avx2(uint32_t * state, const uint8_t * blocks,
+                                                                      size_t count) {
+    const __m256i bswap = _mm256_broadcastsi128_si256(_mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL));
+    const __m256i lo    = _mm256_set_epi64x(0, -1, 0, -1);
+    alignas(32) uint32_t wk[2][64];
+
+    while (count > 0) {
+        const uint8_t * second = count > 1 ? blocks + 64 : blocks;
+        __m256i         x[4];
+        for (int i = 0; i < 4; ++i) {
+            const __m128i a = _mm_loadu_si128((const __m128i *) (blocks + 16 * i));
+            const __m128i b = _mm_loadu_si128((const __m128i *) (second + 16 * i));
+            x[i] = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(a), b, 1), bswap);
+        }
+
+#pragma GCC unroll 16
+        for (int g = 0; g < 16; ++g) {
+            if (g >= 4) {
+                // W[t..t+3] from X0 = W[t-16..], X1 = W[t-12..], X2 = W[t-8..], X3 = W[t-4..]
+                const __m256i w15 = _mm256_alignr_epi8(x[1], x[0], 4);
+                const __m256i w7  = _mm256_alignr_epi8(x[3], x[2], 4);
+                __m256i       w   = _mm256_add_epi32(_mm256_add_epi32(x[0], sigma0_256(w15)), w7);
+                // sigma1 of W[t-2], W[t-1] gives the low pair, which then feeds the high pair
+                w = _mm256_add_epi32(w, _mm256_and_si256(sigma1_256(_mm256_shuffle_epi32(x[3], 0xEE)), lo));
+                w = _mm256_add_epi32(w, _mm256_andnot_si256(lo, sigma1_256(_mm256_shuffle_epi32(w, 0x44))));
+                x[0] = x[1];
+                x[1] = x[2];
+                x[2] = x[3];
+                x[3] = w;
+            }
+
+            const __m256i cur = x[g < 4 ? g : 3];
+            const __m256i k   = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) &sha256_k[4 * g]));
+            const __m256i sum = _mm256_add_epi32(cur, k);
+            _mm_store_si128((__m128i *) &wk[0][4 * g], _mm256_castsi256_si128(sum));
+            _mm_store_si128((__m128i *) &wk[1][4 * g], _mm256_extracti128_si256(sum, 1));
+        }
+
+        const int n = count > 1 ? 2 : 1;
+        for (int blk = 0; blk < n; ++blk) {
+            uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+            uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+            for (int i = 0; i < 64; ++i) {
+                const uint32_t t1 =
+                    h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + wk[blk][i];
+                const uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                h                 = g;
+                g                 = f;
+                f                 = e;
+                e                 = d + t1;
+                d                 = c;
+                c                 = b;
+                b                 = a;
+                a                 = t1 + t2;
+            }
+
+            state[0] += a;
+            state[1] += b;
+            state[2] += c;
+            state[3] += d;
+            state[4] += e;
+            state[5] += f;
+            state[6] += g;
+            state[7] += h;
+        }
+
+        blocks += 64 * n;
+        count -= n;
+    }
+}
+
+static bool cpu_has_shani() {
+    unsigned a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSSE3) || !(c & bit_SSE4_1)) {
+        return false;
+    }
+
+    return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1u << 29));
+}
+
+static bool cpu_has_avx2() {
+    unsigned a, b, c, d;
+    // AVX state must also be enabled by the OS (OSXSAVE and XCR0 bits 1-2)
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return false;
+    }
+
+    unsigned xcr0_lo, xcr0_hi;
+    __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6) {
+        return false;
+    }
+
+    return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_AVX2) && (b & bit_BMI2);
+}
+#endif
+
+static bool cpu_has_nothing_special() {
+    return true;
+}
+
+struct sha256_impl {
+    const char * name;
+    void (*compress)(uint32_t * state, const uint8_t * blocks, size_t count);
+    bool (*supported)();
+};
+
+// In order of preference
+static const sha256_impl sha256_impls[] = {
+#if defined(LM_PULL_X86)
+    { "shani", sha256_compress_shani, cpu_has_shani },
+    { "avx2", sha256_compress_avx2, cpu_has_avx2 },
+#endif
+    { "portable", sha256_compress_portable, cpu_has_nothing_special },
+};
+
+static const sha256_impl * sha256_best() {
+    for (const sha256_impl & impl : sha256_impls) {
+        if (impl.supported()) {
+            return &impl;
+        }
+    }
+
+    return nullptr;
+}
+
+// Kernel used by every digest check; chosen from the CPU at startup, or by --sha256
+static const sha256_impl * sha256_active = sha256_best();
+
+static int sha256_select(const std::string & name) {
+    if (name == "auto") {
+        sha256_active = sha256_best();
+
+        return 0;
+    }
+
+    for (const sha256_impl & impl : sha256_impls) {
+        if (name == impl.name) {
+            if (!impl.supported()) {
+                printe("SHA-256 kernel %s is not supported by this CPU\n", name.c_str());
+
+                return 1;
+            }
+
+            sha256_active = &impl;
+
+            return 0;
+        }
+    }
+
+    printe("Unknown SHA-256 kernel: %s\n", name.c_str());
+
+    return 1;
+}
+
+class Sha256 {
+  public:
+    explicit Sha256(const sha256_impl * impl = sha256_active) : compress(impl->compress) {}
+
+    void update(const void * data, size_t size) {
+        const uint8_t * p = static_cast<const uint8_t *>(data);
+        length += size;
+        if (buffered) {
+            const size_t n = std::min(size, sizeof(buffer) - buffered);
+            memcpy(buffer + buffered, p, n);
+            buffered += n;
+            p += n;
+            size -= n;
+            if (buffered < sizeof(buffer)) {
+                return;
+            }
+
+            compress(state, buffer, 1);
+            buffered = 0;
+        }
+
+        if (size >= sizeof(buffer)) {
+            compress(state, p, size / sizeof(buffer));
+            p += size / sizeof(buffer) * sizeof(buffer);
+            size %= sizeof(buffer);
+        }
+
+        memcpy(buffer, p, size);
+        buffered = size;
+    }
+
+    // Pad the message and return the digest as lowercase hex; the object is spent afterwards
+    std::string hex_digest() {
+        const uint64_t bits = length * 8;
+        const uint8_t  pad  = 0x80;
+        const uint8_t  zero = 0;
+        update(&pad, 1);
+        while (buffered != 56) {
+            update(&zero, 1);
+        }
+
+        uint8_t tail[8];
+        for (int i = 0; i < 8; ++i) {
+            tail[i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+        }
+
+        update(tail, sizeof(tail));
+        std::string hex;
+        for (uint32_t word : state) {
+            hex += fmt("%08x", word);
+        }
+
+        return hex;
+    }
+
+  private:
+    void (*compress)(uint32_t * state, const uint8_t * blocks, size_t count);
+    uint32_t state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    uint8_t  buffer[64];
+    size_t   buffered = 0;
+    uint64_t length   = 0;
+};
+
+// Hash the same buffer with every kernel this CPU supports, report the throughput and check they agree
+static int bench_sha256() {
+    const std::string known = "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad";  // "abc"
+    std::vector<uint8_t> buf(256 << 20);
+    uint32_t             x = 2463534242u;
+    for (uint8_t & byte : buf) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        byte = static_cast<uint8_t>(x);
+    }
+
+    std::string reference;
+    int         ret = 0;
+    for (const sha256_impl & impl : sha256_impls) {
+        if (!impl.supported()) {
+            printf("%-10s not supported by this CPU\n", impl.name);
+            continue;
+        }
+
+        Sha256 abc(&impl);
+        abc.update("abc", 3);
+        const bool abc_ok = abc.hex_digest() == known;
+
+        std::string digest;
+        size_t      rounds = 0;
+        const auto  start  = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed{};
+        do {
+            Sha256 sha(&impl);
+            for (size_t off = 0; off < buf.size(); off += 1 << 20) {
+                sha.update(buf.data() + off, 1 << 20);
+            }
+
+            digest  = sha.hex_digest();
+            elapsed = std::chrono::steady_clock::now() - start;
+            ++rounds;
+        } while (elapsed.count() < 1.0);
+
+        if (reference.empty()) {
+            reference = digest;
+        }
+
+        const bool ok = abc_ok && digest == reference;
+        printf("%-10s %6.2f GB/s  %s%s\n", impl.name, rounds * buf.size() / elapsed.count() / 1e9,
+               digest.substr(0, 16).c_str(), ok ? "" : "  MISMATCH");
+        ret = ret || !ok;
+    }
+
+    printf("active: %s\n", sha256_active->name);
+
+    return ret;
+}
+
+// Hashes a download while it is being written, on its own thread so the transfer never waits for SHA-256. Bytes that
+// arrive in order are hashed from a copy; ranges written ahead of the hash (other segments, a resumed prefix, or data
+// that arrived while the hash was behind) are read back from the file once everything before them is there.
+class DigestStream {
+  public:
+    explicit DigestStream(const std::string & path) : path(path), worker(&DigestStream::run, this) {}
+
+    ~DigestStream() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+
+        ready.notify_one();
+        worker.join();
+#if defined(__linux__)
+        if (cache_fd >= 0) {
+            ::close(cache_fd);
+        }
+#endif
+    }
+
+    // Bytes [offset, offset + size) are in the file; pass data to hash them from memory instead of reading them back
+    void add(curl_off_t offset, const void * data, size_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const curl_off_t            end = offset + size;
+        if (end <= fed) {
+            return;
+        }
+
+        if (offset < fed) {
+            // A retry fetched some bytes again; only the part past what was handed over is new
+            data = data ? static_cast<const char *>(data) + (fed - offset) : nullptr;
+            size -= fed - offset;
+            offset = fed;
+        }
+
+        if (offset != fed) {
+            curl_off_t & ahead_end = ahead[offset];
+            ahead_end              = std::max(ahead_end, end);
+
+            return;
+        }
+
+        job next = { offset, static_cast<curl_off_t>(size), {} };
+        if (data) {
+            next.data.assign(static_cast<const char *>(data), static_cast<const char *>(data) + size);
+            queued += size;
+        }
+
+        jobs.push_back(std::move(next));
+        fed = end;
+        for (auto it = ahead.begin(); it != ahead.end() && it->first <= fed; it = ahead.erase(it)) {
+            if (it->second > fed) {
+                jobs.push_back({ fed, it->second - fed, {} });
+                fed = it->second;
+            }
+        }
+
+        ready.notify_one();
+    }
+
+    // Forget everything hashed so far, for a download that starts over from the first byte
+    void reset() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return jobs.empty() && hashed == fed; });
+        ahead.clear();
+        fed    = 0;
+        hashed = 0;
+        queued = 0;
+        failed = false;
+        sha    = Sha256();
+    }
+
+    // True when the copies waiting to be hashed exceed the memory budget; new bytes should then be read back instead
+    bool backlogged() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queued > max_queued;
+    }
+
+    // Wait for the hash to catch up; returns the hex digest, or "" unless exactly size bytes were hashed
+    std::string finish(curl_off_t size) {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return jobs.empty() && hashed == fed; });
+        if (failed || hashed != size) {
+            return "";
+        }
+
+        return sha.hex_digest();
+    }
+
+  private:
+    struct job {
+        curl_off_t        offset;
+        curl_off_t        size;
+        std::vector<char> data;  // empty when the range is read back from the file
+    };
+
+    static constexpr size_t max_queued = 64 << 20;
+
+    std::string                      path;
+    std::mutex                       mutex;
+    std::condition_variable          ready;
+    std::condition_variable          idle;
+    std::deque<job>                  jobs;
+    std::map<curl_off_t, curl_off_t> ahead;       // start -> end of ranges written past fed
+    curl_off_t                       fed    = 0;  // length of the prefix handed to the hashing thread
+    curl_off_t                       hashed = 0;
+    size_t                           queued = 0;  // bytes of copies waiting in jobs
+    bool                             stopping = false;
+    bool                             failed   = false;
+    Sha256                           sha;
+    std::thread                      worker;
+#if defined(__linux__)
+    int                              cache_fd = -1;  // only used to evict what the read-back pulled in
+#endif
+
+    // With --direct, hashing the ranges read back must not bring the download into the page cache after all
+    void drop_read_cache(curl_off_t offset, curl_off_t size) {
+#if defined(__linux__)
+        if (!options.direct) {
+            return;
+        }
+
+        if (cache_fd < 0) {
+            cache_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        }
+
+        if (cache_fd >= 0) {
+            posix_fadvise(cache_fd, offset, size, POSIX_FADV_DONTNEED);
+        }
+#else
+        (void) offset;
+        (void) size;
+#endif
+    }
+
+    void run() {
+        std::ifstream     in;
+        std::vector<char> buf;
+        for (;;) {
+            job next;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (stopping) {
+                    return;
+                }
+
+                next = std::move(jobs.front());
+                jobs.pop_front();
+            }
+
+            bool ok = true;
+            if (!next.data.empty()) {
+                sha.update(next.data.data(), next.data.size());
+            } else {
+                if (!in.is_open()) {
+                    in.open(path, std::ios::binary);
+                }
+
+                in.clear();
+                in.seekg(next.offset);
+                buf.resize(1 << 20);
+                for (curl_off_t left = next.size; ok && left > 0;) {
+                    const std::streamsize n = std::min<curl_off_t>(left, buf.size());
+                    ok                      = static_cast<bool>(in.read(buf.data(), n));
+                    sha.update(buf.data(), n);
+                    left -= n;
+                }
+
+                drop_read_cache(next.offset, next.size);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                queued -= next.data.size();
+                hashed += next.size;
+                failed = failed || !ok;
+            }
+
+            idle.notify_all();
+        }
+    }
+};
+
+// Connection pool, DNS cache and TLS sessions shared by every handle of the process, so the token, manifest and blob
+// requests of a pull reuse each other's connections and handshakes instead of paying for them at every step
+class CurlShare {
+  public:
+    static CurlShare & get() {
+        static CurlShare share;
+        return share;
+    }
+
+    void attach(CURL * curl) {
+        if (share) {
+            curl_easy_setopt(curl, CURLOPT_SHARE, share);
+        }
+    }
+
+    // Release the pooled connections and sessions, must run after the last transfer and before curl_global_cleanup
+    void close() {
+        if (share) {
+            curl_share_cleanup(share);
+            share = nullptr;
+        }
+    }
+
+    // Seed the session cache with tickets saved by a previous run, so the first handshake to each host resumes
+    int load_tls_sessions(const std::string & path) {
+#if LIBCURL_VERSION_NUM >= 0x080c00
+        std::ifstream in(path, std::ios::binary);
+        CURL *        curl = in ? curl_easy_init() : nullptr;
+        if (!curl) {
+            return 1;
+        }
+
+        attach(curl);
+        const curl_off_t          now = time(nullptr);
+        std::vector<unsigned char> key, shmac, sdata;
+        curl_off_t                valid_until = 0;
+        while (read_blob(in, key) && read_blob(in, shmac) && read_blob(in, sdata) &&
+               in.read(reinterpret_cast<char *>(&valid_until), sizeof(valid_until))) {
+            if (valid_until && valid_until <= now) {
+                continue;
+            }
+
+            key.push_back(0);
+            curl_easy_ssls_import(curl, key.size() > 1 ? reinterpret_cast<const char *>(key.data()) : nullptr,
+                                  shmac.empty() ? nullptr : shmac.data(), shmac.size(), sdata.data(), sdata.size());
+        }
+
+        curl_easy_cleanup(curl);
+
+        return 0;
+#else
+        (void) path;
+        return 1;
+#endif
+    }
+
+    int save_tls_sessions(const std::string & path) {
+#if LIBCURL_VERSION_NUM >= 0x080c00
+        CURL * curl = curl_easy_init();
+        if (!curl) {
+            return 1;
+        }
+
+        attach(curl);
+        std::string    data;
+        const CURLcode res = curl_easy_ssls_export(curl, export_session, &data);
+        curl_easy_cleanup(curl);
+        // Session tickets are credentials for resumption, keep them private to the user
+        if (res != CURLE_OK || write_file_atomic(path, data, 0600)) {
+            printe("Failed to save TLS sessions: %s\n", res != CURLE_OK ? curl_easy_strerror(res) : "write error");
+
+            return 1;
+        }
+
+        return 0;
+#else
+        (void) path;
+        return 1;
+#endif
+    }
+
+  private:
+    CURLSH *   share = nullptr;
+    std::mutex locks[CURL_LOCK_DATA_LAST];
+
+    CurlShare() {
+        share = curl_share_init();
+        if (!share) {
+            return;
+        }
+
+        curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock);
+        curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock);
+        curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+
+    static void lock(CURL *, curl_lock_data data, curl_lock_access, void * userptr) {
+        static_cast<CurlShare *>(userptr)->locks[data].lock();
+    }
+
+    static void unlock(CURL *, curl_lock_data data, void * userptr) {
+        static_cast<CurlShare *>(userptr)->locks[data].unlock();
+    }
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+    // Records are length-prefixed key, salted key hash and session data followed by the expiry
+    static bool read_blob(std::ifstream & in, std::vector<unsigned char> & blob) {
+        uint32_t size = 0;
+        if (!in.read(reinterpret_cast<char *>(&size), sizeof(size)) || size > (1 << 20)) {
+            return false;
+        }
+
+        blob.resize(size);
+
+        return static_cast<bool>(in.read(reinterpret_cast<char *>(blob.data()), size));
+    }
+
+    static void write_blob(std::string & out, const void * data, size_t size) {
+        const uint32_t size32 = size;
+        out.append(reinterpret_cast<const char *>(&size32), sizeof(size32));
+        out.append(static_cast<const char *>(data), size);
+    }
+
+    static CURLcode export_session(CURL *, void * userptr, const char * session_key, const unsigned char * shmac,
+                                   size_t shmac_len, const unsigned char * sdata, size_t sdata_len,
+                                   curl_off_t valid_until, int, const char *, size_t) {
+        std::string & out = *static_cast<std::string *>(userptr);
+        write_blob(out, session_key, session_key ? strlen(session_key) : 0);
+        write_blob(out, shmac, shmac_len);
+        write_blob(out, sdata, sdata_len);
+        out.append(reinterpret_cast<const char *>(&valid_until), sizeof(valid_until));
+
+        return CURLE_OK;
+    }
+#endif
+};
+
+// Hosts worth connecting to before a pull needs them: the registry behind a token service, and the CDN hosts an origin
+// redirected blob requests to in earlier runs. Connections opened ahead of time go into the shared pool, and the first
+// transfer that lands on one of those hosts tells whether it found the connection open, which is what gets reported.
+class Preconnect {
+  public:
+    static Preconnect & get() {
+        static Preconnect preconnect;
+        return preconnect;
+    }
+
+    void load(const std::string & path) {
+        const nlohmann::json        json = read_json(path);
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto & item : json.items()) {
+            if (item.value().is_array()) {
+                redirects[item.key()] = item.value().get<std::vector<std::string>>();
+            }
+        }
+    }
+
+    void save(const std::string & path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (changed) {
+            write_json(path, redirects);
+        }
+    }
+
+    // Remember that a request to url ended up on effective, most recent host first
+    void learn(const std::string & url, const std::string & effective) {
+        const std::string from = url_origin(url);
+        const std::string to   = url_origin(effective);
+        if (from == to) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::string> &  targets = redirects[from];
+        if (!targets.empty() && targets.front() == to) {
+            return;
+        }
+
+        targets.erase(std::remove(targets.begin(), targets.end(), to), targets.end());
+        targets.insert(targets.begin(), to);
+        if (targets.size() > max_targets) {
+            targets.resize(max_targets);
+        }
+
+        changed = true;
+    }
+
+    std::vector<std::string> targets(const std::string & url) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto                  it = redirects.find(url_origin(url));
+
+        return it == redirects.end() ? std::vector<std::string>() : it->second;
+    }
+
+    // Claim an origin for a warm-up connection; false when this run already connected to it or is doing so
+    bool begin(const std::string & origin, CURL * curl) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!hosts.emplace(origin, host()).second) {
+            return false;
+        }
+
+        warming.emplace(curl, origin);
+
+        return true;
+    }
+
+    // The warm-up connection is in the pool; setup is what it cost to resolve, connect and handshake
+    void warmed(CURL * curl, bool connected, double setup_ms) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto                  it = warming.find(curl);
+        if (it == warming.end()) {
+            return;
+        }
+
+        host & h = hosts[it->second];
+        warming.erase(it);
+        if (connected) {
+            h.connection = connection(curl);
+            h.setup      = setup_ms;
+            ++connected_hosts;
+        }
+    }
+
+    // Called for every finished transfer. One whose last hop ran on a warm-up connection is credited with the setup
+    // time of that connection, once per host.
+    void finished(CURL * curl, CURLcode res) {
+        if (res != CURLE_OK) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (hosts.empty() || warming.count(curl)) {
+            return;
+        }
+
+        char * effective = nullptr;
+        if (curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &effective) != CURLE_OK || !effective) {
+            return;
+        }
+
+        const auto it = hosts.find(url_origin(effective));
+        if (it == hosts.end() || it->second.connection.empty() || it->second.used ||
+            it->second.connection != connection(curl)) {
+            return;
+        }
+
+        it->second.used = true;
+        ++reused;
+        saved += it->second.setup;
+    }
+
+    int connected() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return connected_hosts;
+    }
+
+    void report() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (connected_hosts > 0) {
+            printe("Pre-connected %d hosts; %d requests found their connection open, saving %.0f ms of setup\n",
+                   connected_hosts, reused, saved);
+        }
+    }
+
+  private:
+    static constexpr size_t max_targets = 4;
+
+    struct host {
+        std::string connection;     // peer and local port of the warm-up connection, empty until it is open
+        bool        used  = false;  // a later transfer ran on it
+        double      setup = 0;      // milliseconds spent on DNS, TCP and TLS by the warm-up
+    };
+
+    // Identifies the connection the last hop of a transfer ran on; a new connection to the same peer gets another
+    // local port
+    static std::string connection(CURL * curl) {
+        char * ip         = nullptr;
+        long   port       = 0;
+        long   local_port = 0;
+        curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &ip);
+        curl_easy_getinfo(curl, CURLINFO_PRIMARY_PORT, &port);
+        curl_easy_getinfo(curl, CURLINFO_LOCAL_PORT, &local_port);
+        if (!ip || !port || !local_port) {
+            return "";
+        }
+
+        return fmt("%s:%ld:%ld", ip, port, local_port);
+    }
+
+    std::mutex                                      mutex;
+    std::map<std::string, std::vector<std::string>> redirects;  // origin -> origins it redirected to
+    bool                                            changed = false;
+    std::map<std::string, host>                     hosts;      // origins connected ahead of time in this run
+    std::unordered_map<CURL *, std::string>         warming;    // warm-up handles still in flight
+    int                                             connected_hosts = 0;
+    int                                             reused          = 0;
+    double                                          saved           = 0;
+};
+
+// Drives every transfer of the process from one curl_multi loop on a background thread, so tokens, manifests, blobs
+// and range segments of any number of pulls overlap without a thread per connection
+class TransferEngine {
+  public:
+    using callback = std::function<void(CURLcode)>;
+
+    static TransferEngine & get() {
+        static TransferEngine engine;
+        return engine;
+    }
+
+    // Queue an easy handle; done runs on the engine thread once the transfer has finished. A delay holds the handle
+    // back without blocking the loop, which is how retries wait out their backoff. Returns the id cancel() takes.
+    uint64_t submit(CURL * curl, callback done, std::chrono::milliseconds delay = std::chrono::milliseconds(0)) {
+        CurlShare::get().attach(curl);
+        std::lock_guard<std::mutex> lock(mutex);
+        const uint64_t              id = ++submitted;
+        pending.push_back({ curl, id, std::move(done), std::chrono::steady_clock::now() + delay });
+        curl_multi_wakeup(multi);
+
+        return id;
+    }
+
+    // Queue an easy handle and block until it has finished
+    CURLcode perform(CURL * curl) {
+        auto                  result = std::make_shared<std::promise<CURLcode>>();
+        std::future<CURLcode> future = result->get_future();
+        submit(curl, [result](CURLcode res) { result->set_value(res); });
+
+        return future.get();
+    }
+
+    // Unpause a transfer whose write callback returned CURL_WRITEFUNC_PAUSE; callable from any thread
+    void resume(CURL * curl) {
+        std::lock_guard<std::mutex> lock(mutex);
+        resuming.push_back(curl);
+        curl_multi_wakeup(multi);
+    }
+
+    // Abort a queued or running transfer; its callback runs with CURLE_ABORTED_BY_CALLBACK unless it already finished.
+    // Transfers are named by the id submit() returned, not by handle, so a cancel that arrives after its transfer
+    // finished matches nothing, even when the same handle has been submitted again meanwhile.
+    void cancel(uint64_t id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancelling.push_back(id);
+        curl_multi_wakeup(multi);
+    }
+
+    // Finish the queued transfers and stop the loop, must run before curl_global_cleanup
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!multi) {
+                return;
+            }
+
+            stopping = true;
+            curl_multi_wakeup(multi);
+        }
+
+        worker.join();
+        curl_multi_cleanup(multi);
+        multi = nullptr;
+    }
+
+    ~TransferEngine() { stop(); }
+
+  private:
+    CURLM *                                    multi = nullptr;
+    std::thread                                worker;
+    std::mutex                                 mutex;
+    struct queued_handle {
+        CURL *                                curl;
+        uint64_t                              id;
+        callback                              done;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    struct running_handle {
+        uint64_t id;
+        callback done;
+    };
+
+    std::vector<queued_handle>                 pending;
+    std::vector<CURL *>                        resuming;
+    std::vector<uint64_t>                      cancelling;
+    std::unordered_map<CURL *, running_handle> running;  // only touched by the engine thread
+    uint64_t                                   submitted = 0;
+    bool                                       stopping  = false;
+
+    TransferEngine() {
+        multi  = curl_multi_init();
+        // Past the budget, libcurl closes an idle connection or holds the transfer back until one is free
+        curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, options.conn_budget);
+        worker = std::thread(&TransferEngine::run, this);
+    }
+
+    // Start the handles that are due; returns how long the loop may sleep before the next one is
+    int add_pending() {
+        std::vector<queued_handle> queued;
+        const auto                 now     = std::chrono::steady_clock::now();
+        int                        timeout = 1000;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto it = pending.begin(); it != pending.end();) {
+                if (it->start <= now) {
+                    queued.push_back(std::move(*it));
+                    it = pending.erase(it);
+                } else {
+                    const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(it->start - now);
+                    timeout         = std::min<int>(timeout, wait.count() + 1);
+                    ++it;
+                }
+            }
+        }
+
+        for (auto & item : queued) {
+            if (curl_multi_add_handle(multi, item.curl) != CURLM_OK) {
+                item.done(CURLE_FAILED_INIT);
+                continue;
+            }
+
+            running.emplace(item.curl, running_handle{ item.id, std::move(item.done) });
+        }
+
+        return timeout;
+    }
+
+    // curl_easy_pause has to run on the thread that drives the handle; handles that finished meanwhile are skipped
+    void resume_paused() {
+        std::vector<CURL *> paused;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            paused.swap(resuming);
+        }
+
+        for (CURL * curl : paused) {
+            if (running.count(curl)) {
+                curl_easy_pause(curl, CURLPAUSE_CONT);
+            }
+        }
+    }
+
+    void cancel_requested() {
+        std::vector<uint64_t> cancelled;
+        std::vector<callback> done;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cancelled.swap(cancelling);
+            for (uint64_t id : cancelled) {
+                for (auto it = pending.begin(); it != pending.end(); ++it) {
+                    if (it->id == id) {
+                        done.push_back(std::move(it->done));
+                        pending.erase(it);
+                        break;
+                    }
+                }
+            }
+        }
+
+        for (uint64_t id : cancelled) {
+            for (auto it = running.begin(); it != running.end(); ++it) {
+                if (it->second.id == id) {
+                    curl_multi_remove_handle(multi, it->first);
+                    done.push_back(std::move(it->second.done));
+                    running.erase(it);
+                    break;
+                }
+            }
+        }
+
+        for (callback & finish : done) {
+            finish(CURLE_ABORTED_BY_CALLBACK);
+        }
+    }
+
+    void run() {
+        for (;;) {
+            const int timeout = add_pending();
+            resume_paused();
+            cancel_requested();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping && running.empty() && pending.empty()) {
+                    break;
+                }
+            }
+
+            int still_running = 0;
+            curl_multi_perform(multi, &still_running);
+
+            CURLMsg * msg    = nullptr;
+            int       queued = 0;
+            while ((msg = curl_multi_info_read(multi, &queued))) {
+                if (msg->msg != CURLMSG_DONE) {
+                    continue;
+                }
+
+                CURL *         curl = msg->easy_handle;
+                const CURLcode res  = msg->data.result;
+                curl_multi_remove_handle(multi, curl);
+                auto     it   = running.find(curl);
+                callback done = std::move(it->second.done);
+                running.erase(it);
+                Preconnect::get().finished(curl, res);
+                done(res);
+            }
+
+            curl_multi_poll(multi, nullptr, 0, timeout, nullptr);
+        }
+    }
+};
+
+// Open connections to the hosts a pull reaches after its first request, so DNS, TCP and TLS overlap with that request.
+// Each warm-up is a HEAD of the origin's root; its response does not matter, only that the connection stays pooled.
+static void preconnect(const std::string & url, bool with_origin) {
+    if (!options.preconnect || options.offline) {
+        return;
+    }
+
+    std::vector<std::string> origins = Preconnect::get().targets(url);
+    if (with_origin) {
+        origins.insert(origins.begin(), url_origin(url));
+    }
+
+    for (const std::string & origin : origins) {
+        CURL * curl = curl_easy_init();
+        if (!curl) {
+            return;
+        }
+
+        if (!Preconnect::get().begin(origin, curl)) {
+            curl_easy_cleanup(curl);
+            continue;
+        }
+
+        curl_easy_setopt(curl, CURLOPT_URL, (origin + "/").c_str());
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
+        TransferEngine::get().submit(curl, [curl](CURLcode res) {
+            long       connects = 0;
+            curl_off_t setup    = 0;
+            curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+            curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &setup);
+            if (setup == 0) {
+                curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &setup);
+            }
+
+            Preconnect::get().warmed(curl, res == CURLE_OK && connects > 0, setup / 1000.0);
+            curl_easy_cleanup(curl);
+        });
+    }
+}
+
+// Other servers holding the same files as an upstream host, such as an internal mirror or a pull-through cache,
+// configured per scheme with --mirror. Transfers report back how each source did, and a source that failed or runs at
+// under a quarter of the fastest one is demoted for the rest of the run.
+class Mirrors {
+  public:
+    static Mirrors & get() {
+        static Mirrors mirrors;
+        return mirrors;
+    }
+
+    void add(const std::string & scheme, std::string base) {
+        while (!base.empty() && base.back() == '/') {
+            base.pop_back();
+        }
+
+        bases[scheme].push_back(base);
+    }
+
+    // The upstream URL followed by the same path on every mirror of the scheme; empty when it has none
+    std::vector<std::string> sources(const std::string & scheme, const std::string & upstream) const {
+        const auto it = bases.find(scheme);
+        if (it == bases.end()) {
+            return {};
+        }
+
+        const std::string        path = upstream.substr(url_origin(upstream).size());
+        std::vector<std::string> urls = { upstream };
+        for (const std::string & base : it->second) {
+            urls.push_back(base + path);
+        }
+
+        return urls;
+    }
+
+    // bytes_per_second is only used when the transfer succeeded
+    void report(const std::string & url, bool ok, double bytes_per_second) {
+        std::lock_guard<std::mutex> lock(mutex);
+        source &                    stats = sources_seen[url_origin(url)];
+        if (!ok) {
+            ++stats.failures;
+
+            return;
+        }
+
+        stats.failures = 0;
+        stats.speed    = stats.speed > 0 ? (stats.speed + bytes_per_second) / 2 : bytes_per_second;
+    }
+
+    // Index of the source for the next request: the fastest one that is not demoted, shared out by the requests each
+    // one already carries, where a source not measured yet counts as fast. When every source is demoted, slow ones
+    // come before the ones that failed, and those by how often they failed. Sources marked in skip are never picked
+    // unless all of them are.
+    size_t pick(const std::vector<std::string> & urls, const std::vector<int> & busy,
+                const std::vector<bool> & skip = {}) {
+        std::lock_guard<std::mutex> lock(mutex);
+        double                      best = 0;
+        for (const std::string & url : urls) {
+            best = std::max(best, sources_seen[url_origin(url)].speed);
+        }
+
+        size_t chosen = 0;
+        auto   rank   = std::make_tuple(3, 0, 0.0);  // tier, failures, -share; lower is better
+        for (size_t i = 0; i < urls.size(); ++i) {
+            if (i < skip.size() && skip[i]) {
+                continue;
+            }
+
+            const source & stats = sources_seen[url_origin(urls[i])];
+            const int      tier  = stats.failures > 0 ? 2 : (stats.speed > 0 && stats.speed < best / 4) ? 1 : 0;
+            const double   speed = stats.speed > 0 ? stats.speed : std::max(best, 1.0);
+            const double   share = speed / (1 + (i < busy.size() ? busy[i] : 0));
+            const auto     next  = std::make_tuple(tier, stats.failures, -share);
+            if (next < rank) {
+                chosen = i;
+                rank   = next;
+            }
+        }
+
+        return chosen;
+    }
+
+  private:
+    struct source {
+        int    failures = 0;  // since the last success
+        double speed    = 0;  // smoothed bytes per second, 0 until measured
+    };
+
+    std::map<std::string, std::vector<std::string>> bases;  // scheme -> mirror origins, set before any pull starts
+    std::mutex                                       mutex;
+    std::map<std::string, source>                    sources_seen;  // origin -> how it performed
+};
+
+// Response times of metadata requests per origin, kept across runs; the hedging delay is learned from them
+class Latencies {
+  public:
+    static Latencies & get() {
+        static Latencies latencies;
+        return latencies;
+    }
+
+    void load(const std::string & path) {
+        const nlohmann::json        json = read_json(path);
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto & item : json.items()) {
+            if (item.value().is_array()) {
+                samples[item.key()] = item.value().get<std::deque<double>>();
+            }
+        }
+    }
+
+    void save(const std::string & path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (changed) {
+            write_json(path, samples);
+        }
+    }
+
+    void record(const std::string & url, double ms) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::deque<double> &        times = samples[url_origin(url)];
+        times.push_back(ms);
+        if (times.size() > window) {
+            times.pop_front();
+        }
+
+        changed = true;
+    }
+
+    // The 95th percentile of recent responses from the origin, or a second until enough of them were seen
+    std::chrono::milliseconds hedge_delay(const std::string & url) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto                  it = samples.find(url_origin(url));
+        if (it == samples.end() || it->second.size() < min_samples) {
+            return std::chrono::milliseconds(1000);
+        }
+
+        std::vector<double> sorted(it->second.begin(), it->second.end());
+        const size_t        rank = sorted.size() * 95 / 100;
+        std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+
+        return std::chrono::milliseconds(std::max<long>(min_delay, static_cast<long>(sorted[rank])));
+    }
+
+  private:
+    static constexpr size_t window      = 64;
+    static constexpr size_t min_samples = 8;
+    static constexpr long   min_delay   = 50;  // below this a hedge would mostly just double the requests
+
+    std::mutex                                mutex;
+    std::map<std::string, std::deque<double>> samples;  // origin -> milliseconds, oldest first
+    bool                                      changed = false;
+};
+
+// Registry bearer tokens by service and scope, reused until shortly before they expire and kept across runs
+class Tokens {
+  public:
+    static Tokens & get() {
+        static Tokens tokens;
+        return tokens;
+    }
+
+    void load(const std::string & path) {
+        const nlohmann::json        json = read_json(path);
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto & item : json.items()) {
+            if (item.value().is_object()) {
+                cache[item.key()] = { item.value().value("token", ""), item.value().value("expires", 0LL) };
+            }
+        }
+    }
+
+    void save(const std::string & path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!changed) {
+            return;
+        }
+
+        const long long now  = unix_time();
+        nlohmann::json  json = nlohmann::json::object();
+        for (const auto & item : cache) {
+            if (item.second.expires > now) {
+                json[item.first] = { { "token", item.second.token }, { "expires", item.second.expires } };
+            }
+        }
+
+        // Tokens grant pull access to whatever the user can pull, keep them private to the user
+        write_json(path, json, 0600);
+    }
+
+    // The cached token for key, or "" when there is none with at least a minute left
+    std::string find(const std::string & key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto                  it = cache.find(key);
+        if (it == cache.end() || it->second.expires - unix_time() < min_lifetime) {
+            return "";
+        }
+
+        return it->second.token;
+    }
+
+    void store(const std::string & key, const std::string & token, long long expires) {
+        std::lock_guard<std::mutex> lock(mutex);
+        cache[key] = { token, expires };
+        changed    = true;
+    }
+
+    void forget(const std::string & key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        changed = cache.erase(key) > 0 || changed;
+    }
+
+    static long long unix_time() {
+        return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+
+  private:
+    // A pull keeps going back to the registry for its blobs, so a token about to expire is not worth reusing
+    static constexpr long long min_lifetime = 60;
+
+    struct token {
+        std::string token;
+        long long   expires = 0;  // unix time
+    };
+
+    std::mutex                   mutex;
+    std::map<std::string, token> cache;  // "<service> <scope>" -> token
+    bool                         changed = false;
+};
+
+// Decouples the network from the disk: curl write callbacks only copy into a bounded ring of large aligned buffers and
+// a writer thread drains it with positional writes, so a writeback or journal stall no longer stops socket reads.
+// When the ring is full the callback pauses its transfer and the writer resumes it once a buffer is free.
+class FileWriter {
+  public:
+    static constexpr size_t buffer_size = 2 << 20;
+    static constexpr size_t alignment   = 4096;
+
+    struct buffer;
+
+    // One sequential producer, the single stream of a download or one range of a segmented one
+    struct stream {
+        CURL *                    curl    = nullptr;
+        curl_off_t                offset  = 0;        // file offset of the next byte handed to write
+        std::atomic<curl_off_t> * done    = nullptr;  // advanced once bytes are on disk, may be null
+        buffer *                  current = nullptr;  // partly filled buffer owned by this stream
+        bool                      paused  = false;
+        std::chrono::steady_clock::time_point paused_at;
+    };
+
+    struct buffer {
+        char *                    data   = nullptr;
+        size_t                    used   = 0;
+        curl_off_t                offset = 0;
+        std::atomic<curl_off_t> * done   = nullptr;
+        int                       index  = -1;  // registered buffer slot when writing through io_uring
+    };
+
+    FileWriter(File & out, DigestStream * digest, size_t count, bool use_uring = options.io_uring) :
+        out(out),
+        digest(digest),
+        buffers(count) {
+        for (buffer & buf : buffers) {
+            buf.data = static_cast<char *>(::operator new[](buffer_size, std::align_val_t(alignment)));
+            spare.push_back(&buf);
+        }
+
+        start_uring(use_uring);
+        worker = std::thread(&FileWriter::run, this);
+    }
+
+    ~FileWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+
+        ready.notify_one();
+        worker.join();
+        for (buffer & buf : buffers) {
+            ::operator delete[](buf.data, std::align_val_t(alignment));
+        }
+    }
+
+    // Returns size once the bytes are queued, CURL_WRITEFUNC_PAUSE when the ring has no room for them (nothing is
+    // consumed then, curl delivers the same bytes again after the resume) and 0 after a failed write
+    size_t write(stream & s, const void * ptr, size_t size) {
+        std::unique_lock<std::mutex> lock(mutex);
+        const auto                   now = std::chrono::steady_clock::now();
+        if (s.paused) {
+            s.paused = false;
+            net_blocked += now - s.paused_at;
+        }
+
+        if (failed) {
+            return 0;
+        }
+
+        const size_t room   = s.current ? buffer_size - s.current->used : 0;
+        const size_t needed = size > room ? (size - room + buffer_size - 1) / buffer_size : 0;
+        if (needed > spare.size()) {
+            s.paused    = true;
+            s.paused_at = now;
+            waiting.push_back(s.curl);
+
+            return CURL_WRITEFUNC_PAUSE;
+        }
+
+        const char * p = static_cast<const char *>(ptr);
+        for (size_t left = size; left > 0;) {
+            if (!s.current) {
+                s.current = spare.back();
+                spare.pop_back();
+                s.current->used   = 0;
+                s.current->offset = s.offset;
+                s.current->done   = s.done;
+            }
+
+            const size_t n = std::min(left, buffer_size - s.current->used);
+            memcpy(s.current->data + s.current->used, p, n);
+            s.current->used += n;
+            s.offset += n;
+            p += n;
+            left -= n;
+            if (s.current->used == buffer_size) {
+                queue(s);
+            }
+        }
+
+        return size;
+    }
+
+    // Hand the stream's partly filled buffer to the writer, at the end of its transfer
+    void flush(stream & s) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (s.current) {
+            queue(s);
+        }
+    }
+
+    // Wait until every queued buffer is on disk; returns 1 if any write failed
+    int finish() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return queued.empty() && !writing; });
+
+        return failed ? 1 : 0;
+    }
+
+    // The path the writer thread actually took, io_uring falls back to pwritev when the kernel refuses it
+    const char * backend() const {
+#if defined(LM_PULL_IO_URING)
+        if (uring) {
+            return fixed ? "io_uring" : "io_uring (unregistered buffers)";
+        }
+#endif
+        return "pwritev";
+    }
+
+    void print_stats(const std::string & name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const double     seconds = std::chrono::duration<double>(disk_busy).count();
+        const curl_off_t cached  = out.cached_bytes();
+        printe("%s: wrote %.1f MiB with %s%s in %.2fs (%.0f MiB/s), network waited %.2fs for the disk, disk waited "
+               "%.2fs for the network",
+               name.c_str(), bytes / 1048576.0, backend(), out.direct() ? " and O_DIRECT" : "", seconds,
+               seconds > 0 ? bytes / 1048576.0 / seconds : 0.0, std::chrono::duration<double>(net_blocked).count(),
+               std::chrono::duration<double>(disk_idle).count());
+        if (cached >= 0) {
+            printe(", %.1f MiB of the file left in the page cache", cached / 1048576.0);
+        }
+
+        printe("\n");
+    }
+
+  private:
+    // A buffer handed to the disk; retired in submission order so done counters only ever cover written prefixes
+    struct in_flight {
+        buffer * buf     = nullptr;
+        size_t   written = 0;
+        bool     done    = false;
+        bool     ok      = true;
+    };
+
+    File &                   out;
+    DigestStream *           digest;
+    std::vector<buffer>      buffers;
+    std::vector<buffer *>    spare;
+    std::deque<buffer *>     queued;
+    std::vector<CURL *>      waiting;  // transfers paused for want of a spare buffer
+    std::mutex               mutex;
+    std::condition_variable  ready;
+    std::condition_variable  idle;
+    bool                     writing  = false;
+    bool                     stopping = false;
+    bool                     failed   = false;
+    curl_off_t               bytes    = 0;
+    std::chrono::steady_clock::duration net_blocked{};  // transfers paused on a full ring
+    std::chrono::steady_clock::duration disk_idle{};    // writer waiting for a buffer to fill
+    std::chrono::steady_clock::duration disk_busy{};    // writer inside pwritev or io_uring_enter
+#if defined(LM_PULL_IO_URING)
+    std::unique_ptr<IoUring> uring;
+    bool                     fixed = false;  // buffers are registered with the ring
+#endif
+    std::thread              worker;
+
+    void queue(stream & s) {
+        queued.push_back(s.current);
+        s.current = nullptr;
+        ready.notify_one();
+    }
+
+    // Set up the ring and register the buffers with it; false sends the writer back to pwritev
+    bool start_uring(bool use_uring) {
+#if defined(LM_PULL_IO_URING)
+        if (!use_uring) {
+            return false;
+        }
+
+        uring = std::make_unique<IoUring>();
+        if (uring->init(buffers.size()) || !uring->supports(IORING_OP_WRITE)) {
+            static std::once_flag warned;
+            std::call_once(warned, [] { printe("io_uring is not available, writing with pwrite\n"); });
+            uring.reset();
+
+            return false;
+        }
+
+        std::vector<iovec> iov;
+        for (buffer & buf : buffers) {
+            buf.index = iov.size();
+            iov.push_back({ buf.data, buffer_size });
+        }
+
+        // Registration can fail on a low RLIMIT_MEMLOCK; plain io_uring writes still save the syscalls
+        fixed = !uring->register_buffers(iov);
+
+        return true;
+#else
+        if (use_uring) {
+            static std::once_flag warned;
+            std::call_once(warned, [] { printe("io_uring is not available, writing with pwrite\n"); });
+        }
+
+        return false;
+#endif
+    }
+
+    // Wait for buffers to write, or for the end; returns false once stopping with nothing left
+    bool take(std::unique_lock<std::mutex> & lock, bool block) {
+        const auto waited = std::chrono::steady_clock::now();
+        if (block) {
+            ready.wait(lock, [this] { return stopping || !queued.empty(); });
+        }
+
+        disk_idle += std::chrono::steady_clock::now() - waited;
+
+        return !queued.empty() || !stopping;
+    }
+
+    // Account for written buffers and wake whoever waits on them; called with the batch in submission order
+    void retire(const std::vector<in_flight> & batch) {
+        for (const in_flight & item : batch) {
+            if (item.ok && digest) {
+                digest->add(item.buf->offset, digest->backlogged() ? nullptr : item.buf->data, item.buf->used);
+            }
+
+            if (item.ok && item.buf->done) {
+                *item.buf->done += item.buf->used;
+            }
+        }
+
+        std::vector<CURL *> paused;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const in_flight & item : batch) {
+                bytes += item.buf->used;
+                failed = failed || !item.ok;
+                spare.push_back(item.buf);
+            }
+
+            paused.swap(waiting);
+        }
+
+        for (CURL * curl : paused) {
+            if (curl) {
+                TransferEngine::get().resume(curl);
+            }
+        }
+    }
+
+    void run() {
+#if defined(LM_PULL_IO_URING)
+        if (uring) {
+            run_uring();
+            return;
+        }
+#endif
+        std::vector<in_flight> batch;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (!take(lock, true)) {
+                    return;
+                }
+
+                // Buffers that continue each other go out in one pwritev
+                batch.clear();
+                do {
+                    batch.push_back({ queued.front() });
+                    queued.pop_front();
+                } while (!queued.empty() && batch.size() < 64 &&
+                         queued.front()->offset == batch.back().buf->offset + static_cast<curl_off_t>(batch.back().buf->used));
+
+                writing = true;
+            }
+
+            std::vector<std::pair<const char *, size_t>> parts;
+            for (const in_flight & item : batch) {
+                parts.emplace_back(item.buf->data, item.buf->used);
+            }
+
+            const auto start = std::chrono::steady_clock::now();
+            const bool ok    = !out.pwritev(parts, batch.front().buf->offset);
+            const auto end   = std::chrono::steady_clock::now();
+            for (in_flight & item : batch) {
+                item.ok = ok;
+            }
+
+            retire(batch);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                disk_busy += end - start;
+                writing = false;
+            }
+
+            idle.notify_all();
+        }
+    }
+
+#if defined(LM_PULL_IO_URING)
+    // Keeps up to one write per buffer in the kernel: everything queued since the last round goes out in a single
+    // io_uring_enter, and the writer only sleeps in the kernel when there is nothing new to submit
+    void run_uring() {
+        std::deque<in_flight>  flying;
+        std::vector<in_flight> finished;
+        for (;;) {
+            size_t taken = 0;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (!take(lock, flying.empty()) && flying.empty()) {
+                    return;
+                }
+
+                while (!queued.empty() && flying.size() < uring->entries()) {
+                    flying.push_back({ queued.front() });
+                    queued.pop_front();
+                    ++taken;
+                }
+
+                writing = !flying.empty();
+            }
+
+            for (size_t i = flying.size() - taken; i < flying.size(); ++i) {
+                submit(flying[i]);
+            }
+
+            const auto start = std::chrono::steady_clock::now();
+            const bool ok    = !uring->submit(taken ? 0 : 1);
+            const auto end   = std::chrono::steady_clock::now();
+            bool       resubmit = false;
+            uring->reap([&](uint64_t user_data, int res) {
+                in_flight & item = *reinterpret_cast<in_flight *>(user_data);
+                if (res == -EINTR || res == -EAGAIN || (res > 0 && item.written + res < item.buf->used)) {
+                    item.written += std::max(res, 0);
+                    submit(item);
+                    resubmit = true;
+                    return;
+                }
+
+                item.ok   = res > 0;
+                item.done = true;
+            });
+
+            if (!ok) {
+                // The ring itself broke; nothing in flight will complete
+                for (in_flight & item : flying) {
+                    item.ok   = false;
+                    item.done = true;
+                }
+            } else if (resubmit) {
+                uring->submit(0);
+            }
+
+            finished.clear();
+            while (!flying.empty() && flying.front().done) {
+                if (flying.front().ok) {
+                    out.written(flying.front().buf->offset, flying.front().buf->used);
+                }
+
+                finished.push_back(flying.front());
+                flying.pop_front();
+            }
+
+            retire(finished);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                disk_busy += end - start;
+                writing = !flying.empty() || !queued.empty();
+            }
+
+            idle.notify_all();
+        }
+    }
+
+    void submit(in_flight & item) {
+        const buffer & buf = *item.buf;
+        const curl_off_t offset = buf.offset + item.written;
+        const size_t     size   = buf.used - item.written;
+        uring->write(out.descriptor(offset, size), buf.data + item.written, size, offset, fixed ? buf.index : -1,
+                     reinterpret_cast<uint64_t>(&item));
+    }
+#endif
+};
+
+// Push 1 GiB through each write path in the 16 KiB pieces curl delivers and report throughput, CPU time and context
+// switches; the stdio path is what downloads used before the writer thread
+static int bench_write() {
+    const std::string  path  = "lm-pull-bench-write.tmp";
+    const curl_off_t   total = 1LL << 30;
+    std::vector<char>  chunk(CURL_MAX_WRITE_SIZE);
+    uint32_t           x = 2463534242u;
+    for (char & byte : chunk) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        byte = static_cast<char>(x);
+    }
+
+    struct method {
+        const char * name;
+        int          kind;  // 0 stdio, 1 writer thread with pwritev, 2 writer thread with io_uring
+    };
+
+    const method methods[] = { { "fwrite", 0 }, { "pwritev", 1 }, { "io_uring", 2 } };
+    for (const method & m : methods) {
+        std::error_code ec;
+        std::filesystem::remove(path, ec);
+        File out;
+        if (!(m.kind == 0 ? out.open(path, "wb") : out.open_rw(path))) {
+            printe("Failed to open %s\n", path.c_str());
+
+            return 1;
+        }
+
+#ifndef _WIN32
+        rusage before;
+        getrusage(RUSAGE_SELF, &before);
+#endif
+        const std::clock_t cpu   = std::clock();
+        const auto         start = std::chrono::steady_clock::now();
+        bool               ok    = true;
+        std::string        name  = m.name;
+        if (m.kind == 0) {
+            for (curl_off_t written = 0; ok && written < total; written += chunk.size()) {
+                ok = fwrite(chunk.data(), 1, chunk.size(), out.file) == chunk.size();
+            }
+
+            ok = ok && fflush(out.file) == 0;
+        } else {
+            FileWriter         writer(out, nullptr, 8, m.kind == 2);
+            FileWriter::stream stream;
+            name = writer.backend();
+            while (stream.offset < total) {
+                const size_t res = writer.write(stream, chunk.data(), chunk.size());
+                if (res == 0) {
+                    break;
+                }
+
+                if (res == CURL_WRITEFUNC_PAUSE) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+                }
+            }
+
+            writer.flush(stream);
+            ok = !writer.finish() && stream.offset == total;
+        }
+
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const double cpu_s   = static_cast<double>(std::clock() - cpu) / CLOCKS_PER_SEC;
+        long         switches = 0;
+#ifndef _WIN32
+        rusage after;
+        getrusage(RUSAGE_SELF, &after);
+        switches = (after.ru_nvcsw - before.ru_nvcsw) + (after.ru_nivcsw - before.ru_nivcsw);
+#endif
+        printf("%-10s %6.2f GB/s  cpu %5.2fs  %7ld context switches%s\n", name.c_str(), total / elapsed / 1e9, cpu_s,
+               switches, ok ? "" : "  FAILED");
+        if (!ok) {
+            std::filesystem::remove(path, ec);
+
+            return 1;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+
+    return 0;
+}
+
+class HttpClient {
+  public:
+    // sources lists the upstream URL and its mirrors when the file can be fetched from more than one place
+    int init(const std::string & upstream, const std::vector<std::string> & headers, const std::string & output_file,
+             const bool progress, std::string * response_str = nullptr, const std::string & digest = "",
+             const curl_off_t expected_size = -1, const std::vector<std::string> & sources = {}) {
+        std::string output_file_partial;
+        curl = curl_easy_init();
+        if (!curl) {
+            return 1;
+        }
+
+        std::string              url    = upstream;
+        std::vector<std::string> ranked = { upstream };
+        if (!output_file.empty() && sources.size() > 1) {
+            set_headers(headers);
+            ranked = race_sources(sources);
+            url    = ranked[0];
+        }
+
+        progress_data                 data;
+        File                          out;
+        std::unique_ptr<DigestStream> hasher;
+        std::unique_ptr<FileWriter>   ring;
+        if (!output_file.empty()) {
+            output_file_partial = output_file + ".partial";
+            if (starts_with(digest, "sha256:")) {
+                hasher = std::make_unique<DigestStream>(output_file_partial);
+            }
+
+            segmented_state state;
+            state.digest = hasher.get();
+            if (prepare_segments(url, headers, output_file_partial, state, ranked.size())) {
+                state.show_progress = progress;
+                if (download_segments(ranked, output_file_partial, state) ||
+                    verify_digest(hasher.get(), digest, state.size, output_file_partial)) {
+                    return 1;
+                }
+
+                return commit_file(output_file_partial, output_file);
+            }
+
+            if (!out.open_rw(output_file_partial, options.direct)) {
+                printe("Failed to open file\n");
+
+                return 1;
+            }
+
+            if (out.lock()) {
+                printe("Failed to exclusively lock file\n");
+
+                return 1;
+            }
+
+            ring = std::make_unique<FileWriter>(out, hasher.get(), ring_buffers(1));
+        }
+
+        stream_writer writer;
+        writer.ring        = ring.get();
+        writer.out         = &out;
+        writer.path        = output_file_partial;
+        writer.stream.curl = curl;
+        writer.source      = url_origin(url);
+        set_write_options(response_str, writer);
+        data.file_size       = set_resume_point(output_file_partial);
+        if (out.direct() && data.file_size % File::direct_alignment) {
+            // Direct writes start on a block boundary, so the unaligned end of the last run is fetched again
+            data.file_size -= data.file_size % File::direct_alignment;
+            out.resize(data.file_size);
+            curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, static_cast<curl_off_t>(data.file_size));
+        }
+
+        writer.stream.offset = data.file_size;
+        totals.resumed += data.file_size;
+        if (ring && expected_size > 0) {
+            // The manifest already told us the size, so a full disk fails before the first request
+            if (reserve_space(out, output_file_partial, expected_size, data.file_size, true)) {
+                return 1;
+            }
+
+            writer.reserved = true;
+        }
+
+        if (hasher) {
+            // The prefix left by an earlier run is hashed from disk while the rest streams in behind it
+            hasher->add(0, nullptr, data.file_size);
+        }
+
+        set_progress_options(progress, data);
+        std::vector<std::string> request_headers =
+            resume_headers(headers, output_file_partial, data.file_size, writer.source);
+        failure_run failures;
+        CURLcode    res = CURLE_OK;
+        for (;;) {
+            const curl_off_t from = writer.stream.offset;
+            // Once a blob request was redirected to a signed URL, retries go there directly
+            const std::string target = response_str ? url : signed_target(url);
+            set_headers(target == url ? request_headers : without_credentials(request_headers));
+            res = response_str && options.hedge ? perform_hedged(url, *response_str) : perform(target);
+            if (!response_str && target == url) {
+                remember_target(url, curl);
+            }
+
+            if (ring) {
+                // Whatever arrived is written out even on failure, the retry or the next run resumes after it
+                ring->flush(writer.stream);
+                if (ring->finish()) {
+                    printe("Failed to write %s\n", output_file_partial.c_str());
+
+                    return 1;
+                }
+            }
+
+            // libcurl itself rejects a 200 or a Content-Range that does not start at the resume point
+            const long status = response_code();
+            if (ring && res == CURLE_RANGE_ERROR) {
+                writer.restart = true;
+            } else if (ring && res == CURLE_HTTP_RETURNED_ERROR && status == 416 && writer.stream.offset > 0) {
+                const curl_off_t size = expected_size > 0 ? expected_size : content_range_size(writer.headers);
+                if (writer.stream.offset == size) {
+                    // An earlier run got every byte but stopped before the rename; the size is the manifest's, or
+                    // else the one the server gives in Content-Range: bytes */<size>
+                    res = CURLE_OK;
+                    break;
+                }
+
+                writer.restart = true;
+            }
+
+            if (writer.restart) {
+                printe("\nThe server did not resume %s at byte %lld, starting it over\n", output_file.c_str(),
+                       static_cast<long long>(writer.stream.offset));
+                if (out.resize(0)) {
+                    printe("Failed to truncate %s\n", output_file_partial.c_str());
+
+                    return 1;
+                }
+
+                if (hasher) {
+                    hasher->reset();
+                }
+
+                totals.resumed -= data.file_size;
+                data.file_size       = 0;
+                writer.stream.offset = 0;
+                writer.restart       = false;
+                writer.reserved      = false;
+                writer.checked       = false;
+                writer.headers.clear();
+                curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, static_cast<curl_off_t>(0));
+                request_headers = headers;
+                data.start_time = std::chrono::steady_clock::now();
+                continue;
+            }
+
+            // A signed URL that expired is resolved again through the source, resuming where it stopped
+            const bool refused = target != url && expired(res, status);
+
+            if (res != CURLE_OK) {
+                const size_t source = std::find(ranked.begin(), ranked.end(), url) - ranked.begin();
+                failures.failed(writer.stream.offset > from, refused ? std::string::npos : source, ranked.size());
+            }
+
+            // With mirrors, a failed source is demoted and a retryable failure moves the transfer to the best source
+            // that has not failed since bytes last arrived, at once. Once every source has, the download fails.
+            std::string next_url  = url;
+            bool        exhausted = false;
+            if (ranked.size() > 1 && !refused) {
+                curl_off_t speed = 0;
+                curl_easy_getinfo(curl, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+                Mirrors::get().report(url, res == CURLE_OK, speed);
+                exhausted = res != CURLE_OK && failures.exhausted();
+                if (res != CURLE_OK && !exhausted && retryable(res, status)) {
+                    next_url = ranked[Mirrors::get().pick(ranked, {}, failures.sources)];
+                }
+            }
+
+            const bool switched = next_url != url;
+            const auto delay =
+                res == CURLE_OK || exhausted ? std::chrono::milliseconds(-1) :
+                refused                      ? std::chrono::milliseconds(0) :
+                                               retry_delay(res, failures.attempts++, failures.since, nullptr, switched);
+            if (exhausted) {
+                printe("\n%s failed on every source\n", output_file.empty() ? url.c_str() : output_file.c_str());
+            }
+
+            if (delay.count() < 0) {
+                break;
+            }
+
+            if (switched) {
+                printe("\n%s failed (%s), continuing from %s\n", url_origin(url).c_str(), curl_easy_strerror(res),
+                       url_origin(next_url).c_str());
+                url           = next_url;
+                writer.source = url_origin(url);
+            } else if (refused) {
+                forget_target(url);
+                printe("\nThe signed URL from %s expired, resolving it again\n", url_origin(url).c_str());
+            } else if (stalled(res)) {
+                avoid_peer(connected_peer(curl), curl);
+            }
+
+            std::this_thread::sleep_for(delay);
+            if (response_str) {
+                response_str->clear();
+                response_headers.clear();
+            } else {
+                data.file_size = set_resume_point(output_file_partial);
+                if (out.direct() && data.file_size % File::direct_alignment) {
+                    // Rewrite from the block boundary instead of truncating what the hash may still read back
+                    data.file_size -= data.file_size % File::direct_alignment;
+                    curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, static_cast<curl_off_t>(data.file_size));
+                }
+
+                writer.stream.offset = data.file_size;
+                writer.checked       = false;
+                writer.headers.clear();
+                totals.resumed += data.file_size;
+                request_headers = resume_headers(headers, output_file_partial, data.file_size, writer.source);
+            }
+
+            data.start_time = std::chrono::steady_clock::now();
+        }
+
+        if (ring && options.stats) {
+            ring->print_stats(output_file);
+        }
+
+        if (res != CURLE_OK) {
+            printe("curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+
+            return 1;
+        }
+
+        if (!output_file.empty()) {
+            if (verify_digest(hasher.get(), digest, writer.stream.offset, output_file_partial)) {
+                return 1;
+            }
+
+            std::error_code ec;
+            std::filesystem::remove(output_file_partial + ".json", ec);
+
+            return commit_file(output_file_partial, output_file);
+        }
+
+        return 0;
+    }
+
+    // Fetch only the headers of url, without following a redirect, so its validators can be compared with a cached copy
+    int head(const std::string & url, const std::vector<std::string> & headers) {
+        curl = curl_easy_init();
+        if (!curl) {
+            return 1;
+        }
+
+        set_headers(headers);
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(curl, CURLOPT_DEFAULT_PROTOCOL, "https");
+        curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, capture_data);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response_headers);
+        set_stall_options(curl);
+
+        return TransferEngine::get().perform(curl) == CURLE_OK ? 0 : 1;
+    }
+
+    // POST a form, such as a batch of HuggingFace paths, and keep the response body
+    int post(const std::string & url, const std::vector<std::string> & headers, const std::string & form,
+             std::string & response) {
+        curl = curl_easy_init();
+        if (!curl) {
+            return 1;
+        }
+
+        set_headers(headers);
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, form.c_str());
+        curl_easy_setopt(curl, CURLOPT_DEFAULT_PROTOCOL, "https");
+        curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, capture_data);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response_headers);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, capture_data);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+        set_stall_options(curl);
+
+        return TransferEngine::get().perform(curl) == CURLE_OK ? 0 : 1;
+    }
+
+    // Status and headers of the last response to a metadata request or head(), from whichever copy of a hedged
+    // request answered
+    long response_code() const {
+        long status = hedge_status;
+        if (curl && !status) {
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+        }
+
+        return status;
+    }
+
+    std::string response_header(const std::string & name) const { return get_header(response_headers, name); }
+
+    ~HttpClient() {
+        if (chunk) {
+            curl_slist_free_all(chunk);
+        }
+
+        for (curl_slist * list : resolves) {
+            curl_slist_free_all(list);
+        }
+
+        for (curl_slist * list : { validated_chunk, direct_chunk, direct_validated_chunk }) {
+            if (list) {
+                curl_slist_free_all(list);
+            }
+        }
+
+        if (curl) {
+            curl_easy_cleanup(curl);
+        }
+    }
+
+  private:
+    CURL *              curl  = nullptr;
+    struct curl_slist * chunk   = nullptr;
+    std::mutex                resolves_mutex;
+    std::vector<curl_slist *> resolves;  // addresses pinned for hosts that served a stalled flow, one list per retry
+    struct curl_slist * validated_chunk = nullptr;  // chunk plus the If-Range of a segmented download
+    struct curl_slist * direct_chunk    = nullptr;  // chunk without credentials, for ranges sent to a signed URL
+    struct curl_slist * direct_validated_chunk = nullptr;
+    std::string         response_headers;  // of metadata requests, for their validators
+    long                hedge_status = 0;  // of the last metadata request when its hedge answered first
+
+    // Signed CDN URLs that blob and resolve endpoints redirected to, keyed by the URL that was requested
+    struct signed_url {
+        std::string                           url;
+        std::chrono::system_clock::time_point expires;  // max() when the URL does not say
+    };
+
+    std::mutex                        targets_mutex;
+    std::map<std::string, signed_url> targets;
+
+    // Failures of a transfer since it last received bytes. The retry count and time cap apply to each such run, so a
+    // long download that drops now and then keeps its retries however long it has been going. Moving to another
+    // source is a retry too, and a source that failed during the run is not tried again until bytes arrive.
+    struct failure_run {
+        bool                                  failing  = false;
+        int                                   attempts = 0;  // retries during the run
+        std::chrono::steady_clock::time_point since;          // first failure of the run
+        std::vector<bool>                     sources;        // which of the transfer's sources failed during the run
+
+        // progressed: the attempt that failed received bytes before it did; source is npos when it is not to blame
+        void failed(bool progressed, size_t source, size_t count) {
+            if (!failing || progressed) {
+                failing  = true;
+                attempts = 0;
+                since    = std::chrono::steady_clock::now();
+                sources.assign(count, false);
+            }
+
+            if (!progressed && source < sources.size()) {
+                sources[source] = true;
+            }
+        }
+
+        bool exhausted() const { return std::find(sources.begin(), sources.end(), false) == sources.end(); }
+    };
+
+    struct stream_writer {
+        FileWriter *       ring = nullptr;
+        FileWriter::stream stream;
+        File *             out = nullptr;
+        std::string        path;
+        bool               reserved = false;  // space for the whole file is already set aside
+        std::string        headers;           // of the current response, to validate a resume
+        std::string        source;            // origin the request goes to, saved with the validators
+        bool               checked  = false;  // the response was validated
+        bool               restart  = false;  // the response could not continue the prefix on disk
+    };
+
+    // Enough buffers that every producer can hold a partly filled one while others are being written
+    static size_t ring_buffers(int producers) { return std::max(8, 2 * producers); }
+
+    void set_write_options(std::string * response_str, stream_writer & writer) {
+        if (response_str) {
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, capture_data);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, response_str);
+            curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, capture_data);
+            curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response_headers);
+        } else {
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &writer);
+            curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, capture_data);
+            curl_easy_setopt(curl, CURLOPT_HEADERDATA, &writer.headers);
+        }
+    }
+
+    // A blob that does not hash to the digest it was requested by is discarded before it can be renamed into place
+    static int verify_digest(DigestStream * hasher, const std::string & digest, curl_off_t size,
+                             const std::string & output_file_partial) {
+        if (!hasher) {
+            return 0;
+        }
+
+        const std::string actual = "sha256:" + hasher->finish(size);
+        if (actual == digest) {
+            return 0;
+        }
+
+        printe("Digest mismatch for %s: got %s\n", digest.c_str(), actual.c_str());
+        std::error_code ec;
+        std::filesystem::remove(output_file_partial, ec);
+        std::filesystem::remove(output_file_partial + ".json", ec);
+
+        return 1;
+    }
+
+    size_t set_resume_point(const std::string & output_file) {
+        size_t file_size = 0;
+        if (std::filesystem::exists(output_file)) {
+            file_size = std::filesystem::file_size(output_file);
+            curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, static_cast<curl_off_t>(file_size));
+        }
+
+        return file_size;
+    }
+
+    void set_progress_options(bool progress, progress_data & data) {
+        if (progress) {
+            curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+            curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &data);
+            curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, update_progress);
+        }
+    }
+
+    void set_headers(const std::vector<std::string> & headers) {
+        if (chunk) {
+            curl_slist_free_all(chunk);
+            chunk = 0;
+        }
+
+        for (const auto & header : headers) {
+            chunk = curl_slist_append(chunk, header.c_str());
+        }
+
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, chunk);
+    }
+
+    // Decide whether to split the download into ranges and build the segment table, resuming from the sidecar or
+    // from the prefix left by a single-stream download
+    bool prepare_segments(const std::string & url, const std::vector<std::string> & headers,
+                          const std::string & output_file_partial, segmented_state & state, size_t sources) {
+        // A single-stream download keeps only its validators in the sidecar, a segmented one also the table
+        state.path                   = output_file_partial + ".json";
+        const nlohmann::json sidecar = read_json(state.path);
+        bool                 have_state = sidecar.contains("segments");
+        if (options.connections <= 1 && !have_state) {
+            return false;
+        }
+
+        set_headers(headers);
+        state.size   = probe_size(url, state.etag, state.last_modified);
+        state.source = url_origin(url);
+        curl_easy_reset(curl);
+        if (state.size <= 0) {
+            if (have_state) {
+                // The segment table is useless without range support, start over with a single stream
+                std::filesystem::remove(state.path);
+                std::filesystem::remove(output_file_partial);
+            }
+
+            return false;
+        }
+
+        if (!same_object(sidecar, state.etag, state.last_modified, state.source)) {
+            printe("%s changed on the server, starting it over\n", output_file_partial.c_str());
+            std::filesystem::remove(state.path);
+            std::filesystem::remove(output_file_partial);
+            have_state = false;
+        }
+
+        if (have_state && load_segments(state)) {
+            return true;
+        }
+
+        // With several sources, smaller ranges let the faster ones take on more of the file
+        const curl_off_t min_segment = 1 << 20;
+        const curl_off_t slots       = options.connections * (sources > 1 ? 4 : 1);
+        const curl_off_t count       = std::clamp<curl_off_t>(state.size / min_segment, 1, slots);
+        if (count <= 1 && !have_state) {
+            return false;
+        }
+
+        // Keep range boundaries aligned so each connection writes whole pages
+        curl_off_t segment_size = (state.size + count - 1) / count;
+        segment_size            = (segment_size + min_segment - 1) / min_segment * min_segment;
+        curl_off_t prefix       = 0;
+        if (!have_state && std::filesystem::exists(output_file_partial)) {
+            prefix = std::filesystem::file_size(output_file_partial);
+            if (prefix > state.size) {
+                prefix = 0;
+            }
+        }
+
+        state.segments = std::vector<segment>((state.size + segment_size - 1) / segment_size);
+        state.resumed  = 0;
+        for (size_t i = 0; i < state.segments.size(); ++i) {
+            segment & seg = state.segments[i];
+            seg.start     = i * segment_size;
+            seg.end       = std::min(state.size, seg.start + segment_size);
+            seg.done      = std::clamp<curl_off_t>(prefix - seg.start, 0, seg.end - seg.start);
+            state.resumed += seg.done;
+        }
+
+        return true;
+    }
+
+    // Ask for the first byte to learn the object size and whether byte ranges are honoured
+    curl_off_t probe_size(const std::string & url, std::string & etag, std::string & last_modified) {
+        std::string response_headers;
+        size_t      received = 0;
+        curl_easy_setopt(curl, CURLOPT_RANGE, "0-0");
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, capture_data);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response_headers);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_data);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &received);
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(curl, CURLOPT_DEFAULT_PROTOCOL, "https");
+        curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+        set_stall_options(curl);
+        if (TransferEngine::get().perform(curl) != CURLE_OK) {
+            return -1;
+        }
+
+        learn_redirect(url);
+        remember_target(url, curl);
+
+        long code = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+        if (code != 206) {
+            return -1;
+        }
+
+        // Only the headers of the final response matter when redirects were followed
+        etag                            = get_header(response_headers, "etag");
+        last_modified                   = get_header(response_headers, "last-modified");
+        const std::string content_range = get_header(response_headers, "content-range");
+        const size_t      slash         = content_range.rfind('/');
+        if (slash == std::string::npos) {
+            return -1;
+        }
+
+        return std::strtoll(content_range.c_str() + slash + 1, nullptr, 10);
+    }
+
+    static bool load_segments(segmented_state & state) {
+        try {
+            std::ifstream        in(state.path);
+            const nlohmann::json json = nlohmann::json::parse(in);
+            if (json.at("size").get<curl_off_t>() != state.size) {
+                return false;
+            }
+
+            const auto & ranges = json.at("segments");
+            state.segments      = std::vector<segment>(ranges.size());
+            state.resumed       = 0;
+            curl_off_t expected = 0;
+            for (size_t i = 0; i < ranges.size(); ++i) {
+                segment & seg = state.segments[i];
+                seg.start     = ranges[i].at(0).get<curl_off_t>();
+                seg.end       = ranges[i].at(1).get<curl_off_t>();
+                seg.done      = ranges[i].at(2).get<curl_off_t>();
+                if (seg.start != expected || seg.end <= seg.start || seg.done < 0 || seg.done > seg.end - seg.start) {
+                    return false;
+                }
+
+                expected = seg.end;
+                state.resumed += seg.done;
+            }
+
+            return expected == state.size;
+        } catch (const std::exception &) {
+            return false;
+        }
+    }
+
+    // Persist the segment table, at most once a second unless forced
+    static void save_segments(segmented_state & state, bool force) {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        const auto                  now = std::chrono::steady_clock::now();
+        if (!force && now - state.last_save < std::chrono::seconds(1)) {
+            return;
+        }
+
+        state.last_save     = now;
+        nlohmann::json json = { { "size", state.size },
+                                { "etag", state.etag },
+                                { "last_modified", state.last_modified },
+                                { "source", state.source },
+                                { "segments", nlohmann::json::array() } };
+        for (const segment & seg : state.segments) {
+            json["segments"].push_back({ seg.start, seg.end, seg.done.load() });
+        }
+
+        write_json(state.path, json);
+    }
+
+    // Resume only if the object is still the one the prefix came from; otherwise the server sends all of it
+    // Validators are only comparable when the prefix came from the same source
+    static std::vector<std::string> resume_headers(const std::vector<std::string> & headers,
+                                                   const std::string & output_file_partial, curl_off_t resume_from,
+                                                   const std::string & source) {
+        std::vector<std::string> request_headers = headers;
+        if (resume_from > 0) {
+            const nlohmann::json sidecar   = read_json(output_file_partial + ".json");
+            const std::string    validator = if_range(sidecar.value("etag", ""), sidecar.value("last_modified", ""));
+            if (!validator.empty() && sidecar.value("source", source) == source) {
+                request_headers.push_back("If-Range: " + validator);
+            }
+        }
+
+        return request_headers;
+    }
+
+    // The If-Range value for a resume: a strong ETag, else Last-Modified, as weak ETags are not allowed there
+    static std::string if_range(const std::string & etag, const std::string & last_modified) {
+        if (!etag.empty() && !starts_with(etag, "W/")) {
+            return etag;
+        }
+
+        return last_modified;
+    }
+
+    // False only when the sidecar and the server both have a validator of the same kind, from the same source, and
+    // they differ
+    static bool same_object(const nlohmann::json & sidecar, const std::string & etag, const std::string & last_modified,
+                            const std::string & source) {
+        if (sidecar.value("source", source) != source) {
+            return true;
+        }
+
+        const std::string saved_etag          = sidecar.value("etag", "");
+        const std::string saved_last_modified = sidecar.value("last_modified", "");
+        if (!saved_etag.empty() && !etag.empty()) {
+            return saved_etag == etag;
+        }
+
+        if (!saved_last_modified.empty() && !last_modified.empty()) {
+            return saved_last_modified == last_modified;
+        }
+
+        return true;
+    }
+
+    // First byte of a 206 response according to its Content-Range, or -1
+    static curl_off_t content_range_start(const std::string & response_headers) {
+        const std::string range = get_header(response_headers, "content-range");
+        if (!starts_with(range, "bytes ") || range.size() < 7 || !isdigit(static_cast<unsigned char>(range[6]))) {
+            return -1;
+        }
+
+        return std::strtoll(range.c_str() + 6, nullptr, 10);
+    }
+
+    // Size of the whole object according to a Content-Range, bytes <first>-<last>/<size> or bytes */<size>, or -1
+    static curl_off_t content_range_size(const std::string & response_headers) {
+        const std::string range = get_header(response_headers, "content-range");
+        const size_t      slash = range.find('/');
+        if (!starts_with(range, "bytes ") || slash == std::string::npos || slash + 1 >= range.size() ||
+            !isdigit(static_cast<unsigned char>(range[slash + 1]))) {
+            return -1;
+        }
+
+        return std::strtoll(range.c_str() + slash + 1, nullptr, 10);
+    }
+
+    struct segment_writer {
+        segmented_state * state   = nullptr;
+        segment *          seg     = nullptr;
+        FileWriter *       ring    = nullptr;
+        FileWriter::stream stream;
+        CURL *             curl     = nullptr;
+        bool               checked  = false;
+        failure_run        failures;      // of this range since it last received bytes
+        curl_off_t         from     = 0;  // offset the current request started at
+        std::string        headers;       // of the current response, to check its Content-Range
+        size_t             source   = 0;  // index into segment_run::sources of the current request
+        bool               direct   = false;  // the request went to the signed URL the source redirected to
+    };
+
+    // Segments in flight on the transfer engine; shared with the completion callbacks
+    struct segment_run {
+        std::mutex                  mutex;
+        std::vector<segment_writer> writers;
+        size_t                      next      = 0;
+        size_t                      in_flight = 0;
+        bool                        failed    = false;
+        bool                        finished  = false;
+        std::promise<void>          done;
+        std::vector<std::string>    sources;    // URLs of the object, the one the table was probed on first
+        std::vector<int>            busy;       // ranges in flight per source
+        std::vector<std::thread>    resolvers;  // lookups of a stalled host's other addresses, joined at the end
+    };
+
+    int download_segments(const std::vector<std::string> & sources, const std::string & output_file_partial,
+                          segmented_state & state) {
+        File out;
+        if (!out.open_rw(output_file_partial, options.direct)) {
+            printe("Failed to open file\n");
+
+            return 1;
+        }
+
+        if (out.lock()) {
+            printe("Failed to exclusively lock file\n");
+
+            return 1;
+        }
+
+        // Every range asks the probed source for the object the table was started on; a changed one answers 200 and
+        // is rejected. Mirrors have validators of their own, their ranges are checked by Content-Range and digest.
+        const std::string validator = if_range(state.etag, state.last_modified);
+        for (const curl_slist * header = chunk; header; header = header->next) {
+            if (!is_credential(header->data)) {
+                direct_chunk = curl_slist_append(direct_chunk, header->data);
+            }
+        }
+
+        if (!validator.empty()) {
+            for (const curl_slist * header = chunk; header; header = header->next) {
+                validated_chunk = curl_slist_append(validated_chunk, header->data);
+                if (!is_credential(header->data)) {
+                    direct_validated_chunk = curl_slist_append(direct_validated_chunk, header->data);
+                }
+            }
+
+            validated_chunk = curl_slist_append(validated_chunk, ("If-Range: " + validator).c_str());
+            direct_validated_chunk =
+                curl_slist_append(direct_validated_chunk, ("If-Range: " + validator).c_str());
+        }
+
+        // The table must exist before the file is extended, otherwise a crash would leave a full-size .partial
+        // that looks complete to a single-stream resume
+        save_segments(state, true);
+        if (reserve_space(out, output_file_partial, state.size, state.resumed, false)) {
+            return 1;
+        }
+
+        if (out.resize(state.size)) {
+            printe("Failed to resize file\n");
+
+            return 1;
+        }
+
+        if (out.direct()) {
+            // Segments start on block boundaries; round what each unfinished one has done down to one as well
+            for (segment & seg : state.segments) {
+                const curl_off_t unaligned = seg.done % File::direct_alignment;
+                if (seg.done < seg.end - seg.start && unaligned) {
+                    seg.done -= unaligned;
+                    state.resumed -= unaligned;
+                }
+            }
+        }
+
+        state.progress.file_size = state.resumed;
+        if (state.digest) {
+            for (const segment & seg : state.segments) {
+                state.digest->add(seg.start, nullptr, seg.done);
+            }
+        }
+
+        FileWriter ring(out, state.digest, ring_buffers(options.connections));
+        auto       run = std::make_shared<segment_run>();
+        run->sources   = sources;
+        run->busy.resize(sources.size());
+        run->writers.resize(state.segments.size());
+        for (size_t i = 0; i < state.segments.size(); ++i) {
+            run->writers[i].state       = &state;
+            run->writers[i].seg         = &state.segments[i];
+            run->writers[i].ring          = &ring;
+            run->writers[i].stream.done   = &state.segments[i].done;
+            run->writers[i].stream.offset = state.segments[i].start + state.segments[i].done;
+        }
+
+        std::future<void> done = run->done.get_future();
+        start_segments(run);
+        done.wait();
+        // A resolver has queued its range before the last one finished, but may still be returning from that
+        for (std::thread & resolver : run->resolvers) {
+            resolver.join();
+        }
+
+        if (state.progress.printed) {
+            printe("\n");
+        }
+
+        if (ring.finish()) {
+            printe("Failed to write %s\n", output_file_partial.c_str());
+            run->failed = true;
+        }
+
+        if (options.stats) {
+            ring.print_stats(output_file_partial.substr(0, output_file_partial.size() - 8));
+        }
+
+        if (run->failed) {
+            save_segments(state, true);
+
+            return 1;
+        }
+
+        std::filesystem::remove(state.path);
+
+        return 0;
+    }
+
+    // Keep up to options.connections segments in flight; runs again on the engine thread as each one finishes
+    void start_segments(const std::shared_ptr<segment_run> & run) {
+        std::lock_guard<std::mutex> lock(run->mutex);
+        while (run->in_flight < static_cast<size_t>(options.connections) && run->next < run->writers.size()) {
+            segment_writer & writer = run->writers[run->next++];
+            if (writer.seg->done == writer.seg->end - writer.seg->start) {
+                continue;
+            }
+
+            writer.source = run->sources.size() > 1 ? Mirrors::get().pick(run->sources, run->busy) : 0;
+            if (!(writer.curl = segment_handle(*run, writer))) {
+                run->failed = true;
+                continue;
+            }
+
+            ++run->in_flight;
+            ++run->busy[writer.source];
+            submit_segment(run, writer, std::chrono::milliseconds(0));
+        }
+
+        if (!run->finished && run->in_flight == 0 && run->next == run->writers.size()) {
+            run->finished = true;
+            run->done.set_value();
+        }
+    }
+
+    void submit_segment(const std::shared_ptr<segment_run> & run, segment_writer & writer,
+                        std::chrono::milliseconds delay) {
+        TransferEngine::get().submit(
+            writer.curl,
+            [this, run, &writer](CURLcode res) {
+                if (finish_segment(run, writer, res)) {
+                    return;
+                }
+
+                start_segments(run);
+            },
+            delay);
+    }
+
+    // Ranges resume from the first byte not yet received; the request covers the rest of the segment
+    CURL * segment_handle(const segment_run & run, segment_writer & writer) {
+        CURL * handle = curl_easy_init();
+        if (!handle) {
+            return nullptr;
+        }
+
+        const segment &   seg   = *writer.seg;
+        const std::string range = fmt("%lld-%lld", static_cast<long long>(writer.stream.offset),
+                                      static_cast<long long>(seg.end - 1));
+        const std::string url   = signed_target(run.sources[writer.source]);
+        const bool        validated = writer.source == 0 && validated_chunk;
+        writer.checked          = false;
+        writer.from             = writer.stream.offset;
+        writer.direct           = url != run.sources[writer.source];
+        writer.stream.curl      = handle;
+        writer.headers.clear();
+        curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(handle, CURLOPT_RANGE, range.c_str());
+        if (writer.direct) {
+            curl_easy_setopt(handle, CURLOPT_HTTPHEADER, validated ? direct_validated_chunk : direct_chunk);
+        } else {
+            curl_easy_setopt(handle, CURLOPT_HTTPHEADER, validated ? validated_chunk : chunk);
+        }
+
+        curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(handle, CURLOPT_DEFAULT_PROTOCOL, "https");
+        curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
+        // HTTP/2 would multiplex every range onto one TCP flow, which is the bottleneck being avoided
+        curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+        set_stall_options(handle);
+        curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_segment);
+        curl_easy_setopt(handle, CURLOPT_WRITEDATA, &writer);
+        curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, capture_data);
+        curl_easy_setopt(handle, CURLOPT_HEADERDATA, &writer.headers);
+        if (writer.state->show_progress) {
+            curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L);
+            curl_easy_setopt(handle, CURLOPT_XFERINFODATA, writer.state);
+            curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, update_segment_progress);
+        }
+
+        return handle;
+    }
+
+    // Runs on the engine thread when a range transfer ends; returns true when the range was queued again to retry
+    bool finish_segment(const std::shared_ptr<segment_run> & run, segment_writer & writer, CURLcode res) {
+        writer.ring->flush(writer.stream);
+        const segment & seg = *writer.seg;
+        if (res == CURLE_OK && writer.stream.offset != seg.end) {
+            res = CURLE_PARTIAL_FILE;
+        }
+
+        // A range refused by an expired signed URL asks the source again at once, from where it stopped
+        long status = 0;
+        curl_easy_getinfo(writer.curl, CURLINFO_RESPONSE_CODE, &status);
+        const bool refused = writer.direct && expired(res, status);
+        if (refused && forget_target(run->sources[writer.source])) {
+            printe("\nThe signed URL from %s expired, resolving it again\n",
+                   url_origin(run->sources[writer.source]).c_str());
+        } else if (!writer.direct) {
+            remember_target(run->sources[writer.source], writer.curl);
+        }
+
+        if (res != CURLE_OK) {
+            writer.failures.failed(writer.stream.offset > writer.from, refused ? std::string::npos : writer.source,
+                                   run->sources.size());
+        }
+
+        // With mirrors, a range that failed in a way worth retrying moves right away to the best source that has not
+        // failed since it last received bytes; the failed one is demoted. Once every source has, the range fails.
+        size_t next_source = writer.source;
+        bool   exhausted   = false;
+        if (run->sources.size() > 1 && !refused) {
+            curl_off_t speed = 0;
+            curl_easy_getinfo(writer.curl, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+            Mirrors::get().report(run->sources[writer.source], res == CURLE_OK, speed);
+            exhausted = res != CURLE_OK && writer.failures.exhausted();
+            std::lock_guard<std::mutex> lock(run->mutex);
+            --run->busy[writer.source];
+            if (res != CURLE_OK) {
+                if (!exhausted && retryable(res, status)) {
+                    next_source = Mirrors::get().pick(run->sources, run->busy, writer.failures.sources);
+                }
+
+                ++run->busy[next_source];
+            }
+        }
+
+        const bool switched = next_source != writer.source;
+        const auto delay    = res == CURLE_OK || exhausted ? std::chrono::milliseconds(-1) :
+                              refused                      ? std::chrono::milliseconds(0) :
+                                                             retry_delay(res, writer.failures.attempts,
+                                                                         writer.failures.since, writer.curl, switched);
+        if (switched && delay.count() >= 0) {
+            printe("\nrange %lld-%lld failed on %s (%s), moving it to %s\n", static_cast<long long>(seg.start),
+                   static_cast<long long>(seg.end - 1), url_origin(run->sources[writer.source]).c_str(),
+                   curl_easy_strerror(res), url_origin(run->sources[next_source]).c_str());
+        }
+
+        CURL * previous = writer.curl;
+        writer.curl     = nullptr;
+        writer.source   = next_source;
+        if (delay.count() >= 0 && (writer.curl = segment_handle(*run, writer))) {
+            const bool avoid = stalled(res) && !switched;
+            const peer stalled_peer = avoid ? connected_peer(previous) : peer();
+            curl_easy_cleanup(previous);
+            writer.failures.attempts += !refused;
+            totals.resumed += writer.stream.offset - seg.start;
+            if (avoid) {
+                // This runs on the engine thread, so the host's other addresses are looked up on a thread of their
+                // own, which queues the range once they are known; the range still counts as in flight meanwhile,
+                // so the download waits for it, and joins the thread before its writers go away
+                std::lock_guard<std::mutex> lock(run->mutex);
+                run->resolvers.emplace_back([this, run, &writer, stalled_peer, delay] {
+                    avoid_peer(stalled_peer, writer.curl);
+                    submit_segment(run, writer, delay);
+                });
+            } else {
+                submit_segment(run, writer, delay);
+            }
+
+            return true;
+        }
+
+        curl_easy_cleanup(previous);
+        if (res != CURLE_OK) {
+            printe("\nrange %lld-%lld failed: %s\n", static_cast<long long>(seg.start),
+                   static_cast<long long>(seg.end - 1), curl_easy_strerror(res));
+        }
+
+        std::lock_guard<std::mutex> lock(run->mutex);
+        run->failed = run->failed || res != CURLE_OK;
+        --run->in_flight;
+        if (res != CURLE_OK && run->sources.size() > 1) {
+            --run->busy[writer.source];
+        }
+
+        return false;
+    }
+
+    static size_t write_segment(void * ptr, size_t size, size_t nmemb, void * stream) {
+        segment_writer * writer = static_cast<segment_writer *>(stream);
+        const size_t     n      = size * nmemb;
+        if (!writer->checked) {
+            // A server that ignores the range, or an object that changed since the table was started, would have us
+            // write the wrong bytes at this offset
+            long code = 0;
+            curl_easy_getinfo(writer->curl, CURLINFO_RESPONSE_CODE, &code);
+            if (code != 206 || content_range_start(writer->headers) != writer->stream.offset) {
+                printe("\nrange %lld-%lld: the server did not send it (HTTP %ld), the object may have changed\n",
+                       static_cast<long long>(writer->stream.offset), static_cast<long long>(writer->seg->end - 1),
+                       code);
+
+                return 0;
+            }
+
+            writer->checked = true;
+        }
+
+        // Only bytes the writer has put on disk count as done in the sidecar
+        if (writer->stream.offset + static_cast<curl_off_t>(n) > writer->seg->end) {
+            return 0;
+        }
+
+        const size_t queued = writer->ring->write(writer->stream, ptr, n);
+        if (queued == n) {
+            save_segments(*writer->state, false);
+        }
+
+        return queued;
+    }
+
+    static int update_segment_progress(void * ptr, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+        segmented_state * state = static_cast<segmented_state *>(ptr);
+        curl_off_t        done  = 0;
+        for (const segment & seg : state->segments) {
+            done += seg.done;
+        }
+
+        std::lock_guard<std::mutex> lock(state->mutex);
+        display_progress(&state->progress, state->size, done - state->resumed);
+
+        return 0;
+    }
+
+    void set_request_options(const std::string & url) {
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(curl, CURLOPT_DEFAULT_PROTOCOL, "https");
+        curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+        set_stall_options(curl);
+    }
+
+    CURLcode perform(const std::string & url) {
+        set_request_options(url);
+        const CURLcode res = TransferEngine::get().perform(curl);
+        if (res == CURLE_OK) {
+            learn_redirect(url);
+        }
+
+        return res;
+    }
+
+    // The next pull from the same origin connects to wherever this request was redirected while it waits for its token
+    // and manifest
+    void learn_redirect(const std::string & url) {
+        char * effective = nullptr;
+        if (curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &effective) == CURLE_OK && effective) {
+            Preconnect::get().learn(url, effective);
+        }
+    }
+
+    // Remember the signed URL a request for source was redirected to, so later ranges and retries skip the redirect
+    void remember_target(const std::string & source, CURL * handle) {
+        long   status    = 0;
+        char * effective = nullptr;
+        curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
+        curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &effective);
+        if ((status != 200 && status != 206) || !effective || url_origin(effective) == url_origin(source)) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(targets_mutex);
+        targets[source] = { effective, signed_url_expiry(effective) };
+    }
+
+    // Where to send a request for source: its signed URL, unless none is known or it expires within a minute
+    std::string signed_target(const std::string & source) {
+        std::lock_guard<std::mutex> lock(targets_mutex);
+        const auto                  it = targets.find(source);
+        if (it == targets.end()) {
+            return source;
+        }
+
+        if (it->second.expires - std::chrono::system_clock::now() < std::chrono::minutes(1)) {
+            targets.erase(it);
+            return source;
+        }
+
+        return it->second.url;
+    }
+
+    // Returns whether there was a signed URL to drop, so concurrent ranges report the expiry once
+    bool forget_target(const std::string & source) {
+        std::lock_guard<std::mutex> lock(targets_mutex);
+        return targets.erase(source) > 0;
+    }
+
+    // CDNs answer an expired signature with 403, some with 410
+    static bool expired(CURLcode res, long status) {
+        return res == CURLE_HTTP_RETURNED_ERROR && (status == 403 || status == 410);
+    }
+
+    // The expiry a signed URL carries: Expires=<unix time> (CloudFront), verify=<unix time>-<mac> (Cloudflare) or
+    // X-Amz-Date plus X-Amz-Expires (S3 and R2)
+    static std::chrono::system_clock::time_point signed_url_expiry(const std::string & url) {
+        const auto param = [&url](const std::string & name) -> std::string {
+            for (const char separator : { '?', '&' }) {
+                const size_t pos = url.find(separator + name + "=");
+                if (pos != std::string::npos) {
+                    const size_t start = pos + name.size() + 2;
+                    return url.substr(start, url.find('&', start) - start);
+                }
+            }
+
+            return "";
+        };
+
+        const auto at = [](long long seconds) {
+            return std::chrono::system_clock::from_time_t(static_cast<time_t>(seconds));
+        };
+
+        std::string value = param("Expires");
+        if (value.empty()) {
+            value = param("verify");
+        }
+
+        if (!value.empty() && isdigit(static_cast<unsigned char>(value[0]))) {
+            return at(std::strtoll(value.c_str(), nullptr, 10));
+        }
+
+        const std::string date    = param("X-Amz-Date");
+        const std::string seconds = param("X-Amz-Expires");
+        std::tm           tm      = {};
+        std::istringstream in(date);
+        if (!seconds.empty() && (in >> std::get_time(&tm, "%Y%m%dT%H%M%SZ"))) {
+#if defined(_WIN32)
+            const time_t signed_at = _mkgmtime(&tm);
+#else
+            const time_t signed_at = timegm(&tm);
+#endif
+            return at(signed_at + std::strtoll(seconds.c_str(), nullptr, 10));
+        }
+
+        return std::chrono::system_clock::time_point::max();
+    }
+
+    // Registry credentials must not reach the CDN host a signed URL points to
+    static bool is_credential(const std::string & header) {
+        static const std::string name = "authorization:";
+        return header.size() >= name.size() &&
+               std::equal(name.begin(), name.end(), header.begin(),
+                          [](char a, char b) { return a == tolower(static_cast<unsigned char>(b)); });
+    }
+
+    static std::vector<std::string> without_credentials(const std::vector<std::string> & headers) {
+        std::vector<std::string> direct;
+        std::copy_if(headers.begin(), headers.end(), std::back_inserter(direct),
+                     [](const std::string & header) { return !is_credential(header); });
+
+        return direct;
+    }
+
+    // Metadata requests are small and on the critical path. When one has not answered within the usual latency of its
+    // origin, a copy goes out on a fresh connection; the first to succeed is used and the other is cancelled.
+    CURLcode perform_hedged(const std::string & url, std::string & response) {
+        struct hedge_state {
+            std::mutex              mutex;
+            std::condition_variable finished;
+            bool                    done[2] = { false, false };
+            CURLcode                res[2]  = { CURLE_OK, CURLE_OK };
+        };
+
+        auto       state  = std::make_shared<hedge_state>();
+        const auto finish = [state](int i) {
+            return [state, i](CURLcode res) {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->done[i] = true;
+                state->res[i]  = res;
+                state->finished.notify_all();
+            };
+        };
+
+        hedge_status = 0;
+        set_request_options(url);
+        // The copy is made before the engine owns the primary; libcurl cannot clone a handle while it is in use
+        CURL *         hedge = curl_easy_duphandle(curl);
+        uint64_t       ids[2] = { TransferEngine::get().submit(curl, finish(0)), 0 };
+        std::unique_lock<std::mutex> lock(state->mutex);
+        const auto answered = [&] { return state->done[0]; };
+        if (!hedge || state->finished.wait_for(lock, Latencies::get().hedge_delay(url), answered)) {
+            state->finished.wait(lock, answered);
+            lock.unlock();
+            curl_easy_cleanup(hedge);
+            record_latency(url, curl, state->res[0]);
+
+            return state->res[0];
+        }
+
+        std::string hedge_body;
+        std::string hedge_headers;
+        curl_easy_setopt(hedge, CURLOPT_WRITEDATA, &hedge_body);
+        curl_easy_setopt(hedge, CURLOPT_HEADERDATA, &hedge_headers);
+        curl_easy_setopt(hedge, CURLOPT_FRESH_CONNECT, 1L);
+        ++totals.hedged;
+        lock.unlock();
+        ids[1] = TransferEngine::get().submit(hedge, finish(1));
+        lock.lock();
+        const auto won = [&](int i) { return state->done[i] && state->res[i] == CURLE_OK; };
+        state->finished.wait(lock, [&] { return won(0) || won(1) || (state->done[0] && state->done[1]); });
+        const int winner = won(1) && !won(0) ? 1 : 0;
+        // A loser that already finished is left alone; both handles stay alive until both callbacks have run
+        if (!state->done[1 - winner]) {
+            TransferEngine::get().cancel(ids[1 - winner]);
+        }
+
+        state->finished.wait(lock, [&] { return state->done[0] && state->done[1]; });
+        lock.unlock();
+        record_latency(url, winner ? hedge : curl, state->res[winner]);
+        if (winner) {
+            curl_easy_getinfo(hedge, CURLINFO_RESPONSE_CODE, &hedge_status);
+            response         = std::move(hedge_body);
+            response_headers = std::move(hedge_headers);
+            ++totals.hedge_wins;
+        }
+
+        curl_easy_cleanup(hedge);
+
+        return state->res[winner];
+    }
+
+    static void record_latency(const std::string & url, CURL * handle, CURLcode res) {
+        curl_off_t elapsed = 0;
+        if (res == CURLE_OK && curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &elapsed) == CURLE_OK) {
+            Latencies::get().record(url, elapsed / 1000.0);
+        }
+    }
+
+    // Fetch the first bytes from every source at once and rank the sources by how fast those arrived. Each result is
+    // reported to Mirrors, so a source that failed here is demoted and sorts last.
+    std::vector<std::string> race_sources(const std::vector<std::string> & sources) {
+        struct entrant {
+            size_t received = 0;
+            double speed    = -1;  // bytes per second, -1 when the source failed
+        };
+
+        std::vector<entrant>    entrants(sources.size());
+        std::mutex              mutex;
+        std::condition_variable finished;
+        size_t                  pending = 0;
+        for (size_t i = 0; i < sources.size(); ++i) {
+            CURL * handle = curl_easy_init();
+            if (!handle) {
+                continue;
+            }
+
+            curl_easy_setopt(handle, CURLOPT_URL, sources[i].c_str());
+            curl_easy_setopt(handle, CURLOPT_RANGE, fmt("0-%zu", race_bytes - 1).c_str());
+            curl_easy_setopt(handle, CURLOPT_HTTPHEADER, chunk);
+            curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+            curl_easy_setopt(handle, CURLOPT_DEFAULT_PROTOCOL, "https");
+            curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
+            set_stall_options(handle);
+            curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, race_data);
+            curl_easy_setopt(handle, CURLOPT_WRITEDATA, &entrants[i].received);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++pending;
+            }
+
+            TransferEngine::get().submit(handle, [&, i, handle](CURLcode res) {
+                entrant &  e       = entrants[i];
+                curl_off_t elapsed = 0;
+                curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &elapsed);
+                remember_target(sources[i], handle);
+                curl_easy_cleanup(handle);
+                // A server that ignores the range is cut off once it has sent enough
+                if (res == CURLE_OK || (res == CURLE_WRITE_ERROR && e.received > race_bytes)) {
+                    e.speed = e.received * 1e6 / std::max<curl_off_t>(elapsed, 1);
+                }
+
+                Mirrors::get().report(sources[i], e.speed >= 0, e.speed);
+                std::lock_guard<std::mutex> lock(mutex);
+                --pending;
+                finished.notify_one();
+            });
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&] { return pending == 0; });
+        std::vector<size_t> order(sources.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+
+        std::stable_sort(order.begin(), order.end(),
+                         [&](size_t a, size_t b) { return entrants[a].speed > entrants[b].speed; });
+        std::vector<std::string> ranked;
+        for (const size_t i : order) {
+            ranked.push_back(sources[i]);
+        }
+
+        return ranked;
+    }
+
+    static constexpr size_t race_bytes = 256 << 10;
+
+    static size_t race_data(void *, size_t size, size_t nmemb, void * stream) {
+        size_t * received = static_cast<size_t *>(stream);
+        *received += size * nmemb;
+        return *received > race_bytes ? 0 : size * nmemb;
+    }
+
+    // Abort a flow that stays under the speed limit for the whole window. libcurl does not measure a transfer while
+    // it is paused, so waiting for the disk never counts as a stall.
+    static void set_stall_options(CURL * handle) {
+        if (options.speed_limit > 0 && options.speed_time > 0) {
+            curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, options.speed_limit);
+            curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, options.speed_time);
+        }
+    }
+
+    // No total timeout is set, so a timeout comes from the speed check or from a peer that never accepted the
+    // connection; either way the retry should go elsewhere
+    static bool stalled(CURLcode res) { return res == CURLE_OPERATION_TIMEDOUT && options.speed_limit > 0; }
+
+    // Where a flow was connected, read from its handle without blocking
+    struct peer {
+        std::string host;
+        std::string ip;
+        long        port = 0;
+    };
+
+    static peer connected_peer(CURL * handle) {
+        peer   p;
+        char * ip  = nullptr;
+        char * url = nullptr;
+        curl_easy_getinfo(handle, CURLINFO_PRIMARY_IP, &ip);
+        curl_easy_getinfo(handle, CURLINFO_PRIMARY_PORT, &p.port);
+        curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &url);
+        if (!ip || !*ip || !url || p.port <= 0) {
+            return p;
+        }
+
+        CURLU * parsed = curl_url();
+        char *  part   = nullptr;
+        if (parsed && curl_url_set(parsed, CURLUPART_URL, url, 0) == CURLUE_OK &&
+            curl_url_get(parsed, CURLUPART_HOST, &part, 0) == CURLUE_OK) {
+            p.host = part;
+            p.ip   = ip;
+            curl_free(part);
+        }
+
+        curl_url_cleanup(parsed);
+
+        return p;
+    }
+
+    // Send the retry of a stalled flow over a new connection and, when the host resolves to other addresses, pin
+    // the host to those so the same slow edge is not picked again. The pin lands in the shared DNS cache and expires
+    // with it. The lookup blocks, so it never runs on the engine thread.
+    void avoid_peer(const peer & stalled_peer, CURL * next) {
+        curl_easy_setopt(next, CURLOPT_FRESH_CONNECT, 1L);
+#if !defined(_WIN32)
+        addrinfo   hints = {};
+        addrinfo * list  = nullptr;
+        hints.ai_socktype = SOCK_STREAM;
+        if (stalled_peer.host.empty() || stalled_peer.host[0] == '[' ||
+            getaddrinfo(stalled_peer.host.c_str(), nullptr, &hints, &list)) {
+            return;
+        }
+
+        std::vector<std::string> others;
+        for (const addrinfo * ai = list; ai; ai = ai->ai_next) {
+            char name[NI_MAXHOST];
+            if (getnameinfo(ai->ai_addr, ai->ai_addrlen, name, sizeof(name), nullptr, 0, NI_NUMERICHOST)) {
+                continue;
+            }
+
+            std::string address = ai->ai_family == AF_INET6 ? fmt("[%s]", name) : name;
+            if (name != stalled_peer.ip && std::find(others.begin(), others.end(), address) == others.end()) {
+                others.push_back(address);
+            }
+        }
+
+        freeaddrinfo(list);
+        if (others.empty()) {
+            return;
+        }
+
+        std::string entry = fmt("+%s:%ld:", stalled_peer.host.c_str(), stalled_peer.port);
+        for (size_t i = 0; i < others.size(); ++i) {
+            entry += (i ? "," : "") + others[i];
+        }
+
+        // Each retry gets a list of its own; the engine thread may be reading an earlier one for another range
+        curl_slist * resolve = curl_slist_append(nullptr, entry.c_str());
+        if (!resolve) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(resolves_mutex);
+            resolves.push_back(resolve);
+        }
+
+        curl_easy_setopt(next, CURLOPT_RESOLVE, resolve);
+        printe("%s served a stalled flow from %s, reconnecting to another of its addresses\n",
+               stalled_peer.host.c_str(), stalled_peer.ip.c_str());
+#else
+        (void) stalled_peer;
+#endif
+    }
+
+    // Failures worth another attempt: the network or the server's state, not the request or the local disk
+    static bool retryable(CURLcode res, long status) {
+        switch (res) {
+            case CURLE_COULDNT_RESOLVE_HOST:
+            case CURLE_COULDNT_CONNECT:
+            case CURLE_OPERATION_TIMEDOUT:
+            case CURLE_PARTIAL_FILE:
+            case CURLE_GOT_NOTHING:
+            case CURLE_SEND_ERROR:
+            case CURLE_RECV_ERROR:
+            case CURLE_SSL_CONNECT_ERROR:
+            case CURLE_HTTP2:
+            case CURLE_HTTP2_STREAM:
+                return true;
+            case CURLE_HTTP_RETURNED_ERROR:
+                return status == 408 || status == 429 || status >= 500;
+            default:
+                return false;
+        }
+    }
+
+    // Backoff before retry number attempt + 1 of a run of failures that began at since, or -1 when the failure is
+    // final. The delay doubles from half a second up to 30s, with the upper half jittered so transfers that failed
+    // together do not retry in lockstep. A retry on another source goes out at once but counts all the same.
+    std::chrono::milliseconds retry_delay(CURLcode res, int attempt, std::chrono::steady_clock::time_point since,
+                                          CURL * handle = nullptr, bool other_source = false) {
+        long status = 0;
+        curl_easy_getinfo(handle ? handle : curl, CURLINFO_RESPONSE_CODE, &status);
+        if (!retryable(res, status) || attempt >= options.retries) {
+            return std::chrono::milliseconds(-1);
+        }
+
+        static thread_local std::mt19937 rng{ std::random_device{}() };
+        const long                       base = std::min(500L << std::min(attempt, 6), 30000L);
+        const long                       jitter = std::uniform_int_distribution<long>(0, base / 2)(rng);
+        const std::chrono::milliseconds  delay(other_source ? 0 : base / 2 + jitter);
+        if (std::chrono::steady_clock::now() + delay - since > std::chrono::seconds(options.retry_time)) {
+            return std::chrono::milliseconds(-1);
+        }
+
+        ++totals.retries;
+        if (other_source) {
+            return delay;
+        }
+
+        const std::string reason = stalled(res) ?
+                                       fmt("Slower than %ld B/s for %lds", options.speed_limit, options.speed_time) :
+                                       curl_easy_strerror(res);
+        printe("\n%s, retrying in %.1fs (%d/%d)\n", reason.c_str(), delay.count() / 1000.0, attempt + 1,
+               options.retries);
+
+        return delay;
+    }
+
+    static std::string human_readable_time(double seconds) {
+        int hrs  = static_cast<int>(seconds) / 3600;
+        int mins = (static_cast<int>(seconds) % 3600) / 60;
+        int secs = static_cast<int>(seconds) % 60;
+
+        if (hrs > 0) {
+            return fmt("%dh %02dm %02ds", hrs, mins, secs);
+        } else if (mins > 0) {
+            return fmt("%dm %02ds", mins, secs);
+        } else {
+            return fmt("%ds", secs);
+        }
+    }
+
+    static std::string human_readable_size(curl_off_t size) {
+        static const char * suffix[] = { "B", "KB", "MB", "GB", "TB" };
+        char                length   = sizeof(suffix) / sizeof(suffix[0]);
+        int                 i        = 0;
+        double              dbl_size = size;
+        if (size > 1024) {
+            for (i = 0; (size / 1024) > 0 && i < length - 1; i++, size /= 1024) {
+                dbl_size = size / 1024.0;
+            }
         }
 
         return fmt("%.2f %s", dbl_size, suffix[i]);
     }
 
-    static int update_progress(void * ptr, curl_off_t total_to_download, curl_off_t now_downloaded, curl_off_t,
-                               curl_off_t) {
-        progress_data * data = static_cast<progress_data *>(ptr);
-        if (total_to_download <= 0) {
-            return 0;
+    static int update_progress(void * ptr, curl_off_t total_to_download, curl_off_t now_downloaded, curl_off_t,
+                               curl_off_t) {
+        progress_data * data = static_cast<progress_data *>(ptr);
+        if (total_to_download <= 0) {
+            return 0;
+        }
+
+        display_progress(data, total_to_download + data->file_size, now_downloaded);
+
+        return 0;
+    }
+
+    // Draw the bar; total_to_download includes the bytes that were already on disk
+    static void display_progress(progress_data * data, curl_off_t total_to_download, curl_off_t now_downloaded) {
+        const curl_off_t now_downloaded_plus_file_size = now_downloaded + data->file_size;
+        const curl_off_t percentage      = calculate_percentage(now_downloaded_plus_file_size, total_to_download);
+        std::string      progress_prefix = generate_progress_prefix(percentage);
+
+        const double speed = calculate_speed(now_downloaded, data->start_time);
+        const double tim   = (total_to_download - now_downloaded) / speed;
+        std::string  progress_suffix =
+            generate_progress_suffix(now_downloaded_plus_file_size, total_to_download, speed, tim);
+
+        int         progress_bar_width = calculate_progress_bar_width(progress_prefix, progress_suffix);
+        std::string progress_bar;
+        generate_progress_bar(progress_bar_width, percentage, progress_bar);
+
+        print_progress(progress_prefix, progress_bar, progress_suffix);
+        data->printed = true;
+    }
+
+    static curl_off_t calculate_percentage(curl_off_t now_downloaded_plus_file_size, curl_off_t total_to_download) {
+        return (now_downloaded_plus_file_size * 100) / total_to_download;
+    }
+
+    static std::string generate_progress_prefix(curl_off_t percentage) {
+        return fmt("%3ld%% |", static_cast<long int>(percentage));
+    }
+
+    static double calculate_speed(curl_off_t now_downloaded, const std::chrono::steady_clock::time_point & start_time) {
+        const auto                          now             = std::chrono::steady_clock::now();
+        const std::chrono::duration<double> elapsed_seconds = now - start_time;
+        return now_downloaded / elapsed_seconds.count();
+    }
+
+    static std::string generate_progress_suffix(curl_off_t now_downloaded_plus_file_size, curl_off_t total_to_download,
+                                                double speed, double estimated_time) {
+        const int width = 10;
+        return fmt("%*s/%*s%*s/s%*s", width, human_readable_size(now_downloaded_plus_file_size).c_str(), width,
+                   human_readable_size(total_to_download).c_str(), width, human_readable_size(speed).c_str(), width,
+                   human_readable_time(estimated_time).c_str());
+    }
+
+    static int calculate_progress_bar_width(const std::string & progress_prefix, const std::string & progress_suffix) {
+        int progress_bar_width = get_terminal_width() - progress_prefix.size() - progress_suffix.size() - 3;
+        if (progress_bar_width < 1) {
+            progress_bar_width = 1;
+        }
+
+        return progress_bar_width;
+    }
+
+    static std::string generate_progress_bar(int progress_bar_width, curl_off_t percentage,
+                                             std::string & progress_bar) {
+        const curl_off_t pos = (percentage * progress_bar_width) / 100;
+        for (int i = 0; i < progress_bar_width; ++i) {
+            progress_bar.append((i < pos) ? "█" : " ");
+        }
+
+        return progress_bar;
+    }
+
+    static void print_progress(const std::string & progress_prefix, const std::string & progress_bar,
+                               const std::string & progress_suffix) {
+        printe("\r%*s\r%s%s| %s", get_terminal_width(), " ", progress_prefix.c_str(), progress_bar.c_str(),
+               progress_suffix.c_str());
+    }
+
+    // Function to hand received data to the writer thread
+    static size_t write_data(void * ptr, size_t size, size_t nmemb, void * stream) {
+        stream_writer * writer = static_cast<stream_writer *>(stream);
+        if (!writer->checked) {
+            // A resume is kept only when the server sent the bytes that follow the ones on disk
+            long code = 0;
+            curl_easy_getinfo(writer->stream.curl, CURLINFO_RESPONSE_CODE, &code);
+            if (writer->stream.offset > 0 &&
+                (code != 206 || content_range_start(writer->headers) != writer->stream.offset)) {
+                writer->restart = true;
+
+                return 0;
+            }
+
+            // Saved before the first byte lands, so the next run can check the prefix against the same object
+            write_json(writer->path + ".json", { { "etag", get_header(writer->headers, "etag") },
+                                                 { "last_modified", get_header(writer->headers, "last-modified") },
+                                                 { "source", writer->source } });
+            writer->checked = true;
+        }
+
+        if (!writer->reserved) {
+            // Without a size from the manifest, the Content-Length of the response is the first chance to know it
+            curl_off_t length = -1;
+            curl_easy_getinfo(writer->stream.curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+            if (length > 0 && reserve_space(*writer->out, writer->path, writer->stream.offset + length,
+                                            writer->stream.offset, true)) {
+                return 0;
+            }
+
+            writer->reserved = true;
+        }
+
+        return writer->ring->write(writer->stream, ptr, size * nmemb);
+    }
+
+    // Check that the filesystem can hold the rest of the file, then reserve its extents
+    static int reserve_space(File & out, const std::string & path, curl_off_t size, curl_off_t on_disk,
+                             bool keep_size) {
+        std::error_code ec;
+        const auto      parent = std::filesystem::absolute(path, ec).parent_path();
+        const auto      info   = std::filesystem::space(parent, ec);
+        const curl_off_t needed = size - on_disk;
+        if (!ec && needed > 0 && info.available < static_cast<uintmax_t>(needed)) {
+            printe("Not enough space for %s: %s needed, %s available\n", path.c_str(),
+                   human_readable_size(needed).c_str(), human_readable_size(info.available).c_str());
+
+            return 1;
+        }
+
+        if (out.preallocate(size, keep_size)) {
+            printe("Failed to reserve %s for %s: %s\n", human_readable_size(size).c_str(), path.c_str(),
+                   strerror(errno));
+
+            return 1;
+        }
+
+        return 0;
+    }
+
+    // Function to drop the body of a range probe, aborting if the server sends more than the byte asked for
+    static size_t discard_data(void *, size_t size, size_t nmemb, void * stream) {
+        size_t * received = static_cast<size_t *>(stream);
+        *received += size * nmemb;
+        return *received > 1 ? 0 : size * nmemb;
+    }
+
+    // Find a header in a captured header block, case-insensitively; the last response wins after redirects
+    static std::string get_header(const std::string & response_headers, const std::string & name) {
+        std::string value;
+        size_t      pos = 0;
+        while (pos < response_headers.size()) {
+            size_t eol = response_headers.find('\n', pos);
+            if (eol == std::string::npos) {
+                eol = response_headers.size();
+            }
+
+            const std::string line  = response_headers.substr(pos, eol - pos);
+            const size_t      colon = line.find(':');
+            if (starts_with(line, "HTTP/")) {
+                value.clear();
+            } else if (colon == name.size() &&
+                       std::equal(name.begin(), name.end(), line.begin(),
+                                  [](char a, char b) { return tolower(a) == tolower(b); })) {
+                const size_t first = line.find_first_not_of(" \t", colon + 1);
+                const size_t last  = line.find_last_not_of(" \t\r");
+                value = first == std::string::npos ? "" : line.substr(first, last - first + 1);
+            }
+
+            pos = eol + 1;
+        }
+
+        return value;
+    }
+
+    // Function to capture data into a string
+    static size_t capture_data(void * ptr, size_t size, size_t nmemb, void * stream) {
+        std::string * str = static_cast<std::string *>(stream);
+        str->append(static_cast<char *>(ptr), size * nmemb);
+        return size * nmemb;
+    }
+};
+
+int download(const std::string & url, const std::vector<std::string> & headers, const std::string & output_file,
+             const bool progress, std::string * response_str = nullptr, const std::string & digest = "",
+             const curl_off_t size = -1, const std::vector<std::string> & sources = {}) {
+    HttpClient http;
+    if (http.init(url, headers, output_file, progress && options.progress, response_str, digest, size, sources)) {
+        return 1;
+    }
+
+    return 0;
+}
+
+// Manifests and file validators from earlier pulls, one JSON file per URL under <cache>/metadata/<host>/<path>
+static std::string metadata_path(const std::string & url) {
+    const size_t scheme = url.find("://");
+
+    return cache_dir() + "/metadata/" + (scheme == std::string::npos ? url : url.substr(scheme + 3)) + ".json";
+}
+
+static nlohmann::json load_metadata(const std::string & url) {
+    return read_json(metadata_path(url));
+}
+
+static void save_metadata(const std::string & url, const nlohmann::json & json) {
+    write_json(metadata_path(url), json);
+}
+
+// Fetch a manifest, sending the ETag of the cached copy as If-None-Match so a tag that has not moved costs one small
+// 304. With --offline the cached copy is used as it is.
+static int fetch_manifest(const std::string & url, const std::vector<std::string> & headers, std::string & manifest) {
+    // Only a manifest that parses is ever cached or used; callers parse it again and count on that
+    const auto valid = [](const std::string & body) { return nlohmann::json::parse(body, nullptr, false).is_object(); };
+
+    const nlohmann::json cached = load_metadata(url);
+    const bool           have   = cached.contains("manifest") && cached["manifest"].is_string() &&
+                              valid(cached["manifest"]);
+    if (options.offline) {
+        if (!have) {
+            printe("%s is not in the cache, it cannot be pulled offline\n", url.c_str());
+
+            return 1;
+        }
+
+        manifest = cached["manifest"];
+
+        return 0;
+    }
+
+    std::vector<std::string> request_headers = headers;
+    if (have && !cached.value("etag", "").empty()) {
+        request_headers.push_back("--header");
+        request_headers.push_back("If-None-Match: " + cached.value("etag", ""));
+    }
+
+    HttpClient http;
+    if (http.init(url, request_headers, "", false, &manifest)) {
+        return 1;
+    }
+
+    if (http.response_code() == 304 && have) {
+        manifest = cached["manifest"];
+
+        return 0;
+    }
+
+    if (!valid(manifest)) {
+        printe("Invalid manifest from %s (HTTP %ld)\n", url.c_str(), http.response_code());
+
+        return 1;
+    }
+
+    save_metadata(url, { { "etag", http.response_header("etag") },
+                         { "digest", http.response_header("docker-content-digest") },
+                         { "manifest", manifest } });
+
+    return 0;
+}
+
+static bool valid_digest(const std::string & digest) {
+    return digest.size() == 71 && starts_with(digest, "sha256:") &&
+           digest.find_first_not_of("0123456789abcdef", 7) == std::string::npos;
+}
+
+// Registry blobs are kept once per digest, whichever registry, repository or tag referenced them
+static std::string blob_store_path(const std::string & digest) {
+    return options.store + "/blobs/sha256-" + digest.substr(7);
+}
+
+static int reflink(const std::string & src, const std::string & dst) {
+#if defined(__linux__) && defined(FICLONE)
+    const int in = ::open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return 1;
+    }
+
+    int       ret = 1;
+    const int out = ::open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (out >= 0) {
+        ret = ioctl(out, FICLONE, in) != 0;
+        ::close(out);
+        if (ret) {
+            unlink(dst.c_str());
+        }
+    }
+
+    ::close(in);
+
+    return ret;
+#else
+    (void) src;
+    (void) dst;
+    return 1;
+#endif
+}
+
+// Copy src into a new dst, in the kernel where copy_file_range is available so the data never crosses into userspace
+static int copy_data(const std::string & src, const std::string & dst) {
+#if defined(__linux__)
+    const int in = ::open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return 1;
+    }
+
+    int       ret = 1;
+    const int out = ::open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (out >= 0) {
+        ssize_t n;
+        while ((n = copy_file_range(in, nullptr, out, nullptr, 1 << 30, 0)) > 0 || (n < 0 && errno == EINTR)) {
+        }
+
+        ret = n != 0;
+        ::close(out);
+        if (ret) {
+            unlink(dst.c_str());
+        }
+    }
+
+    ::close(in);
+    if (!ret) {
+        return 0;
+    }
+#endif
+    std::error_code ec;
+    return !std::filesystem::copy_file(src, dst, ec);
+}
+
+// Make dst hold the contents of src, sharing its extents when the filesystem allows: a reflink, then a hardlink, and
+// a kernel copy across filesystems. dst is replaced atomically.
+static int materialize(const std::string & src, const std::string & dst) {
+    std::error_code ec;
+    if (std::filesystem::exists(dst, ec) && std::filesystem::equivalent(src, dst, ec)) {
+        return 0;
+    }
+
+    const std::string tmp = dst + ".tmp";
+    std::filesystem::remove(tmp, ec);
+    if (reflink(src, tmp)) {
+        std::filesystem::create_hard_link(src, tmp, ec);
+        if (ec && copy_data(src, tmp)) {
+            printe("Failed to create %s: %s\n", dst.c_str(), strerror(errno));
+
+            return 1;
+        }
+    }
+
+    if (commit_file(tmp, dst)) {
+        std::filesystem::remove(tmp, ec);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+// Blobs other tools on this machine already downloaded and verified: Ollama names them like our store does, Docker
+// Model Runner keeps an OCI layout
+static std::vector<std::string> foreign_blob_paths(const std::string & digest) {
+    const std::string        hex = digest.substr(7);
+    std::vector<std::string> paths;
+    if (const char * models = std::getenv("OLLAMA_MODELS")) {
+        paths.push_back(std::string(models) + "/blobs/sha256-" + hex);
+    }
+
+#if defined(_WIN32)
+    const char * home = std::getenv("USERPROFILE");
+#else
+    const char * home = std::getenv("HOME");
+#endif
+    if (home) {
+        paths.push_back(std::string(home) + "/.ollama/models/blobs/sha256-" + hex);
+        paths.push_back(std::string(home) + "/.docker/models/blobs/sha256/" + hex);
+    }
+
+#if defined(__linux__)
+    // The Linux installer runs the Ollama service as its own user
+    paths.push_back("/usr/share/ollama/.ollama/models/blobs/sha256-" + hex);
+#endif
+
+    return paths;
+}
+
+// Bring a blob another tool already holds into the store without touching the network. The digest names the content;
+// the size from the manifest guards against truncated or in-progress files.
+static bool import_blob(const std::string & digest, const curl_off_t size, const std::string & blob) {
+    for (const std::string & path : foreign_blob_paths(digest)) {
+        std::error_code ec;
+        const auto      found = std::filesystem::file_size(path, ec);
+        if (ec || (size >= 0 && found != static_cast<uintmax_t>(size))) {
+            continue;
+        }
+
+        if (!materialize(path, blob)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Fetch a registry blob into the store unless an earlier pull already verified it there, or another local model
+// store has it, then expose it as bn. An empty bn only fills the store, without a progress bar. size is the layer size
+// from the manifest, -1 when unknown; scheme selects the mirrors to fetch it from.
+static int pull_blob(const std::string & url, const std::vector<std::string> & headers, const std::string & digest,
+                     const curl_off_t size, const std::string & bn, const std::string & scheme,
+                     const bool progress = true) {
+    if (!valid_digest(digest)) {
+        printe("Invalid layer digest: '%s'\n", digest.c_str());
+
+        return 1;
+    }
+
+    // Concurrent pulls in this process that share a layer wait for the first one to fetch it
+    static std::mutex                                       mutex;
+    static std::unordered_map<std::string, std::shared_future<int>> fetches;
+    std::promise<int>                                       fetched;
+    std::shared_future<int>                                 fetch;
+    bool                                                    owner = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto                        it = fetches.find(digest);
+        if (it == fetches.end()) {
+            it    = fetches.emplace(digest, fetched.get_future().share()).first;
+            owner = true;
+        }
+
+        fetch = it->second;
+    }
+
+    const std::string blob = blob_store_path(digest);
+    if (owner) {
+        std::error_code ec;
+        int             ret = 0;
+        if (!std::filesystem::exists(blob, ec)) {
+            std::filesystem::create_directories(options.store + "/blobs", ec);
+            const bool imported = import_blob(digest, size, blob);
+            if (!imported && options.offline) {
+                printe("%s is not in the blob store, it cannot be pulled offline\n", digest.c_str());
+                ret = 1;
+            } else if (!imported) {
+                ret = download(url, headers, blob, progress && !bn.empty(), nullptr, digest, size,
+                               Mirrors::get().sources(scheme, url));
+            }
+        }
+
+        fetched.set_value(ret);
+        std::lock_guard<std::mutex> lock(mutex);
+        fetches.erase(digest);
+    }
+
+    if (fetch.get()) {
+        return 1;
+    }
+
+    return bn.empty() ? 0 : materialize(blob, bn);
+}
+
+// Record a pulled model the way Ollama keeps it, manifests/<registry>/<namespace>/<model>/<tag> next to the blobs/
+// directory, so an Ollama runtime pointed at the store runs it in place. Written last, once every blob it lists is
+// there.
+static int write_ollama_manifest(const std::string & model, const std::string & tag, const std::string & manifest) {
+    const std::string path = options.store + "/manifests/registry.ollama.ai/" + model + "/" + tag;
+    const std::string tmp  = path + ".partial";
+    std::error_code   ec;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out << manifest;
+        if (!out) {
+            printe("Failed to write %s\n", tmp.c_str());
+
+            return 1;
+        }
+    }
+
+    return commit_file(tmp, path);
+}
+
+// Size, git oid and LFS sha256 of HuggingFace repository files, the tree entries the API returns. Every file named on
+// the command line is registered up front, so the first lookup in a repository asks paths-info about all of them in a
+// single request, and a repository listing fills it for the files it pulls.
+class HfMetadata {
+  public:
+    static HfMetadata & get() {
+        static HfMetadata metadata;
+        return metadata;
+    }
+
+    // model is <org>/<repo>/<path>; anything else is ignored
+    void want(const std::string & model) {
+        const size_t repo = model.find('/');
+        const size_t path = repo == std::string::npos ? repo : model.find('/', repo + 1);
+        if (path != std::string::npos) {
+            std::lock_guard<std::mutex> lock(mutex);
+            wanted[model.substr(0, path)].push_back(model.substr(path + 1));
+        }
+    }
+
+    void add(const std::string & repo, const nlohmann::json & entries) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto & entry : entries) {
+            files[repo + "/" + entry.value("path", "")] = entry;
+        }
+    }
+
+    // The entry of path in repo, fetched with every other wanted file of the repository when it is not known yet;
+    // false when the API does not list it
+    bool find(const std::string & repo, const std::string & path, const std::vector<std::string> & headers,
+              nlohmann::json & entry) {
+        std::promise<void>       fetched;
+        std::shared_future<void> fetch;
+        std::vector<std::string> paths;
+        bool                     owner = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (lookup(repo, path, entry)) {
+                return true;
+            }
+
+            auto it = fetches.find(repo);
+            if (it == fetches.end()) {
+                it    = fetches.emplace(repo, fetched.get_future().share()).first;
+                owner = true;
+                paths = wanted[repo];
+                wanted.erase(repo);
+                if (std::find(paths.begin(), paths.end(), path) == paths.end()) {
+                    paths.push_back(path);
+                }
+            }
+
+            fetch = it->second;
+        }
+
+        if (owner) {
+            nlohmann::json entries;
+            if (!paths_info(repo, paths, headers, entries)) {
+                add(repo, entries);
+            }
+
+            fetched.set_value();
+            std::lock_guard<std::mutex> lock(mutex);
+            fetches.erase(repo);
+        }
+
+        fetch.get();
+        std::lock_guard<std::mutex> lock(mutex);
+
+        return lookup(repo, path, entry);
+    }
+
+  private:
+    std::mutex                                                 mutex;
+    std::unordered_map<std::string, nlohmann::json>            files;    // keyed by <org>/<repo>/<path>
+    std::unordered_map<std::string, std::vector<std::string>>  wanted;   // paths per repository not asked about yet
+    std::unordered_map<std::string, std::shared_future<void>>  fetches;  // paths-info requests in flight
+
+    bool lookup(const std::string & repo, const std::string & path, nlohmann::json & entry) const {
+        const auto it = files.find(repo + "/" + path);
+        if (it == files.end()) {
+            return false;
+        }
+
+        entry = it->second;
+
+        return true;
+    }
+
+    static int paths_info(const std::string & repo, const std::vector<std::string> & paths,
+                          const std::vector<std::string> & headers, nlohmann::json & entries) {
+        std::string form = "expand=false";
+        for (const std::string & path : paths) {
+            char * escaped = curl_easy_escape(nullptr, path.c_str(), static_cast<int>(path.size()));
+            if (escaped) {
+                form += "&paths=" + std::string(escaped);
+                curl_free(escaped);
+            }
+        }
+
+        HttpClient  http;
+        std::string response;
+        if (http.post("https://huggingface.co/api/models/" + repo + "/paths-info/main", headers, form, response)) {
+            return 1;
+        }
+
+        entries = nlohmann::json::parse(response, nullptr, false);
+
+        return entries.is_array() ? 0 : 1;
+    }
+};
+
+static int huggingface_repo_dl(const std::string & repo, const std::vector<std::string> & headers,
+                               const std::string & dir);
+
+int huggingface_dl(const std::string& model,
+                   const std::vector<std::string> headers,
+                   const std::string& bn,
+                   const bool progress = true) {
+  // Find the second occurrence of '/' after protocol string
+  size_t pos = model.find('/');
+  if (pos == std::string::npos) {
+    return 1;
+  }
+
+  pos = model.find('/', pos + 1);
+  if (pos == std::string::npos) {
+    // No file path: the whole repository
+    return huggingface_repo_dl(model, headers, bn);
+  }
+
+  const std::string hfr = model.substr(0, pos);
+  const std::string hff = model.substr(pos + 1);
+  const std::string url =
+      "https://huggingface.co/" + hfr + "/resolve/main/" + hff;
+  preconnect(url, false);
+
+  // A file pulled before is kept while the resolve endpoint reports the same ETag; for LFS files that is their hash
+  const nlohmann::json cached = load_metadata(url);
+  std::error_code ec;
+  const auto size = std::filesystem::file_size(bn, ec);
+  const bool have =
+      !ec && cached.contains("etag") && cached.value("size", curl_off_t(-1)) == static_cast<curl_off_t>(size);
+  if (options.offline) {
+    if (!have) {
+      printe("%s is not in the cache, it cannot be pulled offline\n", url.c_str());
+      return 1;
+    }
+
+    return 0;
+  }
+
+  // The paths-info entry gives the ETag, size and LFS sha256 without a request per file; a HEAD of the resolve URL
+  // stands in when the API does not answer
+  nlohmann::json entry;
+  std::string etag;
+  std::string digest;
+  curl_off_t expected = -1;
+  if (HfMetadata::get().find(hfr, hff, headers, entry)) {
+    const nlohmann::json lfs = entry.value("lfs", nlohmann::json::object());
+    const std::string oid = lfs.value("oid", "");
+    const std::string id = oid.empty() ? entry.value("oid", "") : oid;
+    etag = id.empty() ? "" : "\"" + id + "\"";
+    digest = oid.empty() ? "" : "sha256:" + oid;
+    expected = entry.value("size", curl_off_t(-1));
+  } else {
+    HttpClient head;
+    if (!head.head(url, headers)) {
+      etag = head.response_header("x-linked-etag");
+      if (etag.empty()) {
+        etag = head.response_header("etag");
+      }
+    }
+  }
+
+  if (have && !etag.empty() && etag == cached.value("etag", "") &&
+      (expected < 0 || expected == static_cast<curl_off_t>(size))) {
+    return 0;
+  }
+
+  const int ret =
+      download(url, headers, bn, progress, nullptr, digest, expected, Mirrors::get().sources("hf", url));
+  if (!ret && !etag.empty()) {
+    save_metadata(url, { { "etag", etag }, { "size", static_cast<curl_off_t>(std::filesystem::file_size(bn, ec)) } });
+  }
+
+  return ret;
+}
+
+// Whether path matches pattern, where * matches any run of characters, / included, and ? any one character, as in
+// the allow and ignore patterns of the HuggingFace tools
+static bool glob_match(const char * pattern, const char * path) {
+    for (; *pattern; ++pattern, ++path) {
+        if (*pattern == '*') {
+            while (*pattern == '*') {
+                ++pattern;
+            }
+
+            for (; *path; ++path) {
+                if (glob_match(pattern, path)) {
+                    return true;
+                }
+            }
+
+            return !*pattern;
         }
 
-        total_to_download += data->file_size;
-        const curl_off_t now_downloaded_plus_file_size = now_downloaded + data->file_size;
-        const curl_off_t percentage      = calculate_percentage(now_downloaded_plus_file_size, total_to_download);
-        std::string      progress_prefix = generate_progress_prefix(percentage);
+        if (!*path || (*pattern != '?' && *pattern != *path)) {
+            return false;
+        }
+    }
 
-        const double speed = calculate_speed(now_downloaded, data->start_time);
-        const double tim   = (total_to_download - now_downloaded) / speed;
-        std::string  progress_suffix =
-            generate_progress_suffix(now_downloaded_plus_file_size, total_to_download, speed, tim);
+    return !*path;
+}
 
-        int         progress_bar_width = calculate_progress_bar_width(progress_prefix, progress_suffix);
-        std::string progress_bar;
-        generate_progress_bar(progress_bar_width, percentage, progress_bar);
+static bool hf_selected(const std::string & path) {
+    const auto matches = [&path](const std::string & pattern) { return glob_match(pattern.c_str(), path.c_str()); };
 
-        print_progress(progress_prefix, progress_bar, progress_suffix);
-        data->printed = true;
+    return (options.include.empty() || std::any_of(options.include.begin(), options.include.end(), matches)) &&
+           std::none_of(options.exclude.begin(), options.exclude.end(), matches);
+}
+
+// The URL of the next page from a Link response header, empty on the last page
+static std::string next_page(const std::string & link) {
+    const size_t rel   = link.find("rel=\"next\"");
+    const size_t start = rel == std::string::npos ? rel : link.rfind('<', rel);
+    const size_t end   = start == std::string::npos ? start : link.find('>', start);
+    if (end == std::string::npos || end > rel) {
+        return "";
+    }
+
+    return link.substr(start + 1, end - start - 1);
+}
+
+// Every file of a HuggingFace repository, from the tree API page by page. The listing is kept in the metadata cache so
+// that an offline pull can select from it.
+static int list_hf_repo(const std::string & repo, const std::vector<std::string> & headers, nlohmann::json & files) {
+    const std::string tree = "https://huggingface.co/api/models/" + repo + "/tree/main";
+    if (options.offline) {
+        const nlohmann::json cached = load_metadata(tree);
+        if (!cached.contains("files") || !cached["files"].is_array()) {
+            printe("%s is not in the cache, it cannot be pulled offline\n", tree.c_str());
+
+            return 1;
+        }
+
+        files = cached["files"];
 
         return 0;
     }
 
-    static curl_off_t calculate_percentage(curl_off_t now_downloaded_plus_file_size, curl_off_t total_to_download) {
-        return (now_downloaded_plus_file_size * 100) / total_to_download;
+    files = nlohmann::json::array();
+    for (std::string url = tree + "?recursive=true"; !url.empty();) {
+        HttpClient  http;
+        std::string response;
+        if (http.init(url, headers, "", false, &response)) {
+            return 1;
+        }
+
+        const nlohmann::json page = nlohmann::json::parse(response, nullptr, false);
+        if (!page.is_array()) {
+            printe("Unexpected listing of %s\n", repo.c_str());
+
+            return 1;
+        }
+
+        for (const auto & entry : page) {
+            if (entry.value("type", "") == "file") {
+                files.push_back(entry);
+            }
+        }
+
+        url = next_page(http.response_header("link"));
     }
 
-    static std::string generate_progress_prefix(curl_off_t percentage) {
-        return fmt("%3ld%% |", static_cast<long int>(percentage));
+    save_metadata(tree, { { "files", files } });
+
+    return 0;
+}
+
+// Files of a pull in flight at once; each has a writer thread and buffers of its own
+static constexpr size_t pull_workers = 4;
+
+// Run job(i) for every i below count on at most pull_workers threads, this one included. Jobs are taken in index order,
+// so callers put the largest file last; returns 1 if any job failed.
+static int run_bounded(size_t count, const std::function<int(size_t)> & job) {
+    std::atomic<size_t> next{ 0 };
+    std::atomic<bool>   failed{ false };
+    const auto          work = [&] {
+        for (size_t i = next++; i < count; i = next++) {
+            if (job(i)) {
+                failed = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < std::min(count, pull_workers); ++i) {
+        workers.emplace_back(work);
     }
 
-    static double calculate_speed(curl_off_t now_downloaded, const std::chrono::steady_clock::time_point & start_time) {
-        const auto                          now             = std::chrono::steady_clock::now();
-        const std::chrono::duration<double> elapsed_seconds = now - start_time;
-        return now_downloaded / elapsed_seconds.count();
+    work();
+    for (auto & worker : workers) {
+        worker.join();
     }
 
-    static std::string generate_progress_suffix(curl_off_t now_downloaded_plus_file_size, curl_off_t total_to_download,
-                                                double speed, double estimated_time) {
-        const int width = 10;
-        return fmt("%*s/%*s%*s/s%*s", width, human_readable_size(now_downloaded_plus_file_size).c_str(), width,
-                   human_readable_size(total_to_download).c_str(), width, human_readable_size(speed).c_str(), width,
-                   human_readable_time(estimated_time).c_str());
+    return failed ? 1 : 0;
+}
+
+// Pull every file of a HuggingFace repository, or those matching --include and no --exclude, into dir. A few workers
+// share the connections and take the files smallest first, so configs and tokenizers are done before the weights
+// start; the largest file comes last and is the one with the progress bar.
+static int huggingface_repo_dl(const std::string & repo, const std::vector<std::string> & headers,
+                               const std::string & dir) {
+    nlohmann::json listing;
+    if (list_hf_repo(repo, headers, listing)) {
+        return 1;
     }
 
-    static int calculate_progress_bar_width(const std::string & progress_prefix, const std::string & progress_suffix) {
-        int progress_bar_width = get_terminal_width() - progress_prefix.size() - progress_suffix.size() - 3;
-        if (progress_bar_width < 1) {
-            progress_bar_width = 1;
+    // The listing already holds every file's size and hashes, so no file needs a lookup of its own
+    HfMetadata::get().add(repo, listing);
+    std::vector<std::pair<curl_off_t, std::string>> files;
+    for (const auto & entry : listing) {
+        const std::string           path = entry.value("path", "");
+        const std::filesystem::path relative(path);
+        const bool                  escapes = relative.is_absolute() ||
+                             std::find(relative.begin(), relative.end(), "..") != relative.end();
+        if (path.empty() || escapes) {
+            printe("Skipping %s, it is not a path inside the repository\n", path.c_str());
+        } else if (hf_selected(path)) {
+            files.emplace_back(entry.value("size", curl_off_t(0)), path);
         }
+    }
 
-        return progress_bar_width;
+    if (files.empty()) {
+        printe("No file of %s matches the filters\n", repo.c_str());
+
+        return 1;
     }
 
-    static std::string generate_progress_bar(int progress_bar_width, curl_off_t percentage,
-                                             std::string & progress_bar) {
-        const curl_off_t pos = (percentage * progress_bar_width) / 100;
-        for (int i = 0; i < progress_bar_width; ++i) {
-            progress_bar.append((i < pos) ? "█" : " ");
+    std::sort(files.begin(), files.end());
+    std::error_code ec;
+    for (const auto & file : files) {
+        std::filesystem::create_directories(std::filesystem::path(dir + "/" + file.second).parent_path(), ec);
+    }
+
+    return run_bounded(files.size(), [&](size_t i) {
+        const std::string & path = files[i].second;
+        return huggingface_dl(repo + "/" + path, headers, dir + "/" + path, i + 1 == files.size());
+    });
+}
+
+// A pull token for a Docker Hub repository, from the cache when one is still valid unless refresh is set. Concurrent
+// pulls of the same repository wait for a single request to the auth service.
+static std::string docker_token(const std::string & model, bool refresh, bool & cached) {
+    const std::string service = "registry.docker.io";
+    const std::string scope   = "repository:" + model + ":pull";
+    const std::string key     = service + " " + scope;
+    static std::mutex                                                       mutex;
+    static std::unordered_map<std::string, std::shared_future<std::string>> fetches;
+    std::promise<std::string>                                               fetched;
+    std::shared_future<std::string>                                         fetch;
+    bool                                                                    owner = false;
+    cached                                                                        = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (refresh) {
+            Tokens::get().forget(key);
         }
 
-        return progress_bar;
-    }
+        const std::string token = Tokens::get().find(key);
+        if (!token.empty()) {
+            cached = true;
+            return token;
+        }
 
-    static void print_progress(const std::string & progress_prefix, const std::string & progress_bar,
-                               const std::string & progress_suffix) {
-        printe("\r%*s\r%s%s| %s", get_terminal_width(), " ", progress_prefix.c_str(), progress_bar.c_str(),
-               progress_suffix.c_str());
+        auto it = fetches.find(key);
+        if (it == fetches.end()) {
+            it    = fetches.emplace(key, fetched.get_future().share()).first;
+            owner = true;
+        }
+
+        fetch = it->second;
     }
 
-    // Function to write data to a file
-    static size_t write_data(void * ptr, size_t size, size_t nmemb, void * stream) {
-        FILE * out = static_cast<FILE *>(stream);
-        return fwrite(ptr, size, nmemb, out);
+    if (owner) {
+        // Docker Hub tokens say how long they last; tokens that do not are valid for 60 seconds
+        const long long requested = Tokens::unix_time();
+        std::string     token;
+        std::string     auth_response;
+        if (download("https://auth.docker.io/token?service=" + service + "&scope=" + scope, {}, "", false,
+                     &auth_response)) {
+            printe("Failed to get authentication token\n");
+        } else {
+            const nlohmann::json auth_json = nlohmann::json::parse(auth_response, nullptr, false);
+            if (!auth_json.is_object() || !auth_json.contains("token")) {
+                printe("No token found in authentication response\n");
+            } else {
+                token = auth_json["token"];
+                Tokens::get().store(key, token, requested + auth_json.value("expires_in", 60LL));
+            }
+        }
+
+        fetched.set_value(token);
+        std::lock_guard<std::mutex> lock(mutex);
+        fetches.erase(key);
     }
 
-    // Function to capture data into a string
-    static size_t capture_data(void * ptr, size_t size, size_t nmemb, void * stream) {
-        std::string * str = static_cast<std::string *>(stream);
-        str->append(static_cast<char *>(ptr), size * nmemb);
-        return size * nmemb;
+    return fetch.get();
+}
+
+// File name of GGUF shard i of n: the layer's title when it has one, else bn numbered the way llama.cpp finds the
+// other shards from the first
+static std::string shard_name(const nlohmann::json & layer, const std::string & bn, const size_t i, const size_t n) {
+    const nlohmann::json annotations = layer.value("annotations", nlohmann::json::object());
+    const std::string    title =
+        std::filesystem::path(annotations.value("org.opencontainers.image.title", "")).filename().string();
+    if (!title.empty() && title != "." && title != "..") {
+        return title;
     }
-};
 
-int download(const std::string & url, const std::vector<std::string> & headers, const std::string & output_file,
-             const bool progress, std::string * response_str = nullptr) {
-    HttpClient http;
-    if (http.init(url, headers, output_file, progress, response_str)) {
-        return 1;
+    std::string stem = bn;
+    if (stem.size() > 5 && stem.compare(stem.size() - 5, 5, ".gguf") == 0) {
+        stem.resize(stem.size() - 5);
     }
 
-    return 0;
+    return stem + fmt("-%05zu-of-%05zu.gguf", i + 1, n);
 }
 
-int huggingface_dl(const std::string& model,
-                   const std::vector<std::string> headers,
-                   const std::string& bn) {
-  // Find the second occurrence of '/' after protocol string
-  size_t pos = model.find('/');
-  pos = model.find('/', pos + 1);
-  if (pos == std::string::npos) {
-    return 1;
-  }
+// Fetch every shard of a split model, and the config and other layers into the store, a few at a time. Files go
+// smallest first, so the largest shard comes last with the progress bar and the pull takes about as long as it does.
+static int docker_shards(const std::string & model, const std::vector<std::string> & headers,
+                         const nlohmann::json & manifest, const std::vector<nlohmann::json> & shards,
+                         const std::string & bn) {
+    struct layer_file {
+        std::string digest;
+        curl_off_t  size = -1;
+        std::string name;  // empty for layers that are only kept in the store
+    };
 
-  const std::string hfr = model.substr(0, pos);
-  const std::string hff = model.substr(pos + 1);
-  const std::string url =
-      "https://huggingface.co/" + hfr + "/resolve/main/" + hff;
-  return download(url, headers, bn, true);
+    std::vector<layer_file> files;
+    for (size_t i = 0; i < shards.size(); ++i) {
+        const std::string name = shard_name(shards[i], bn, i, shards.size());
+        files.push_back({ shards[i].value("digest", ""), shards[i].value("size", curl_off_t(-1)), name });
+    }
+
+    std::vector<nlohmann::json> rest;
+    for (const auto & l : manifest["layers"]) {
+        if (std::find(shards.begin(), shards.end(), l) == shards.end()) {
+            rest.push_back(l);
+        }
+    }
+
+    if (manifest.contains("config")) {
+        rest.push_back(manifest["config"]);
+    }
+
+    for (const auto & l : rest) {
+        files.push_back({ l.value("digest", ""), l.value("size", curl_off_t(-1)), "" });
+    }
+
+    std::stable_sort(files.begin(), files.end(),
+                     [](const layer_file & a, const layer_file & b) { return a.size < b.size; });
+    const std::string blobs_url = "https://registry-1.docker.io/v2/" + model + "/blobs/";
+
+    return run_bounded(files.size(), [&](size_t i) {
+        const layer_file & file = files[i];
+        return pull_blob(blobs_url + file.digest, headers, file.digest, file.size, file.name, "docker",
+                         i + 1 == files.size());
+    });
 }
 
 int docker_dl(std::string& model,
@@ -425,49 +5142,65 @@ int docker_dl(std::string& model,
     model = model.substr(0, colon_pos);
   }
 
-  // Get authentication token for Docker Hub
-  std::string auth_url = "https://auth.docker.io/token?service=registry.docker.io&scope=repository:" + model + ":pull";
-  std::string auth_response;
-  int auth_ret = download(auth_url, {}, "", false, &auth_response);
-  if (auth_ret) {
-    printe("Failed to get authentication token\n");
-    return auth_ret;
-  }
-
-  nlohmann::json auth_json = nlohmann::json::parse(auth_response);
-  if (!auth_json.contains("token")) {
-    printe("No token found in authentication response\n");
-    return 1;
-  }
+  // The registry and its CDN are connected to while the token is fetched
+  preconnect("https://registry-1.docker.io/v2/", true);
 
-  std::string token = auth_json["token"];
   std::vector<std::string> auth_headers = headers;
-  auth_headers.push_back("--header");
-  auth_headers.push_back("Authorization: Bearer " + token);
+  bool cached = false;
+  if (!options.offline) {
+    const std::string token = docker_token(model, false, cached);
+    if (token.empty()) {
+      return 1;
+    }
+
+    auth_headers.push_back("--header");
+    auth_headers.push_back("Authorization: Bearer " + token);
+  }
 
   std::string manifest_url =
       "https://registry-1.docker.io/v2/" + model + "/manifests/" + model_tag;
   std::string manifest_str;
-  const int ret = download(manifest_url, auth_headers, "", false, &manifest_str);
+  int ret = fetch_manifest(manifest_url, auth_headers, manifest_str);
+  if (ret && cached) {
+    // A cached token may have been revoked; try once more with a fresh one
+    const std::string token = docker_token(model, true, cached);
+    if (token.empty()) {
+      return 1;
+    }
+
+    auth_headers.back() = "Authorization: Bearer " + token;
+    ret = fetch_manifest(manifest_url, auth_headers, manifest_str);
+  }
+
   if (ret) {
     return ret;
   }
 
   nlohmann::json manifest = nlohmann::json::parse(manifest_str);
   std::string layer;
+  curl_off_t layer_size = -1;
   size_t max_size = 0;
-  
-  // First, try to find a layer with GGUF mediaType
+
+  // First, try to find the layers with GGUF mediaType; a model split into several shards needs every one of them
+  std::vector<nlohmann::json> shards;
   for (const auto& l : manifest["layers"]) {
     if (l.contains("mediaType")) {
       std::string mediaType = l["mediaType"];
       if (mediaType.find("gguf") != std::string::npos || mediaType.find("GGUF") != std::string::npos) {
-        layer = l["digest"];
-        break;
+        shards.push_back(l);
       }
     }
   }
-  
+
+  if (shards.size() > 1) {
+    return docker_shards(model, auth_headers, manifest, shards, bn);
+  }
+
+  if (!shards.empty()) {
+    layer = shards[0]["digest"];
+    layer_size = shards[0].value("size", curl_off_t(-1));
+  }
+
   // If no GGUF mediaType found, find the largest layer
   if (layer.empty()) {
     for (const auto& l : manifest["layers"]) {
@@ -479,6 +5212,8 @@ int docker_dl(std::string& model,
         }
       }
     }
+
+    layer_size = layer.empty() ? -1 : static_cast<curl_off_t>(max_size);
   }
 
   if (layer.empty()) {
@@ -488,7 +5223,7 @@ int docker_dl(std::string& model,
 
   std::string blob_url =
       "https://registry-1.docker.io/v2/" + model + "/blobs/" + layer;
-  return download(blob_url, auth_headers, bn, true);
+  return pull_blob(blob_url, auth_headers, layer, layer_size, bn, "docker");
 }
 
 int ollama_dl(std::string& model,
@@ -507,30 +5242,84 @@ int ollama_dl(std::string& model,
 
   std::string manifest_url =
       "https://registry.ollama.ai/v2/" + model + "/manifests/" + model_tag;
+  preconnect(manifest_url, false);
   std::string manifest_str;
-  const int ret = download(manifest_url, headers, "", false, &manifest_str);
+  const int ret = fetch_manifest(manifest_url, headers, manifest_str);
   if (ret) {
     return ret;
   }
 
   nlohmann::json manifest = nlohmann::json::parse(manifest_str);
   std::string layer;
+  curl_off_t layer_size = -1;
   for (const auto& l : manifest["layers"]) {
     if (l["mediaType"] == "application/vnd.ollama.image.model") {
       layer = l["digest"];
+      layer_size = l.value("size", curl_off_t(-1));
       break;
     }
   }
 
-  std::string blob_url =
-      "https://registry.ollama.ai/v2/" + model + "/blobs/" + layer;
-  return download(blob_url, headers, bn, true);
+  // The template, params, projector, adapter and license layers and the config are fetched alongside the model
+  // layer, so the small ones do not queue behind it; the model layer goes last, with the progress bar
+  std::vector<nlohmann::json> blobs(manifest["layers"].begin(), manifest["layers"].end());
+  if (manifest.contains("config")) {
+    blobs.push_back(manifest["config"]);
+  }
+
+  std::vector<std::pair<std::string, curl_off_t>> files;
+  for (const auto& l : blobs) {
+    const std::string digest = l.value("digest", "");
+    if (digest != layer) {
+      files.emplace_back(digest, l.value("size", curl_off_t(-1)));
+    }
+  }
+
+  files.emplace_back(layer, layer_size);
+  const int pulled = run_bounded(files.size(), [&](size_t i) {
+    const bool model_layer = i + 1 == files.size();
+    return pull_blob("https://registry.ollama.ai/v2/" + model + "/blobs/" + files[i].first, headers,
+                     files[i].first, files[i].second, model_layer ? bn : "", "ollama", model_layer);
+  });
+  if (pulled) {
+    return pulled;
+  }
+
+  return write_ollama_manifest(model, model_tag, manifest_str);
 }
 
 static void print_usage() {
   printf(
       "Usage:\n"
-      "  lm-pull <model>\n"
+      "  lm-pull [options] <model>...\n"
+      "\n"
+      "Options:\n"
+      "  -c, --connections <n>  parallel connections per file (default: 1)\n"
+      "  --max-connections <n>  connections open at once across all downloads, 0 for no limit\n"
+      "                         (default: 32)\n"
+      "  --store <dir>          blob store shared by every pull (default: ~/.cache/lm-pull)\n"
+      "  --tls-cache            reuse TLS sessions across invocations (libcurl >= 8.12)\n"
+      "  --sha256 <kernel>      SHA-256 kernel: auto, shani, avx2 or portable (default: auto)\n"
+      "  --bench-sha256         measure every SHA-256 kernel this CPU supports\n"
+      "  --stats                print transfer statistics after each download\n"
+      "  --io <backend>         disk writes: pwrite or io_uring (default: pwrite)\n"
+      "  --bench-write          compare fwrite, pwritev and io_uring on a 1 GiB local file\n"
+      "  --direct               keep downloads out of the page cache (O_DIRECT)\n"
+      "  --sync <policy>        durable: sync files before renaming them into place, fast: skip that\n"
+      "                         (default: durable)\n"
+      "  --retries <n>          retries of a failed transfer, resuming where it stopped (default: 5)\n"
+      "  --retry-max-time <s>   stop retrying once a download has received nothing for this many seconds\n"
+      "                         (default: 600)\n"
+      "  --speed-limit <B/s>    replace a connection slower than this, 0 disables (default: 16384)\n"
+      "  --speed-time <s>       how long a connection may stay under the speed limit (default: 30)\n"
+      "  --include <glob>       files of a whole hf:// repository to pull, repeatable (default: all)\n"
+      "  --exclude <glob>       files of a whole hf:// repository to skip, repeatable\n"
+      "  --no-hedge             never send a second copy of a slow token or manifest request\n"
+      "  --no-preconnect        do not connect to the registry and its CDN hosts ahead of time\n"
+      "  --offline              resolve models from the cache only, without network access\n"
+      "  --mirror <scheme>=<url>\n"
+      "                         also fetch ollama, docker or hf files from this server, repeatable\n"
+      "  -h, --help             show this help\n"
       "\n"
       "Examples:\n"
       "  lm-pull llama3\n"
@@ -542,27 +5331,142 @@ static void print_usage() {
       "  lm-pull "
       "huggingface://bartowski/SmolLM-1.7B-Instruct-v0.2-GGUF/"
       "SmolLM-1.7B-Instruct-v0.2-IQ3_M.gguf\n"
-      "  lm-pull https://example.com/some-file1.gguf\n");
+      "  lm-pull --include '*Q4_K_M*.gguf' --include '*.json' hf://bartowski/SmolLM2-135M-Instruct-GGUF\n"
+      "  lm-pull -c 8 https://example.com/some-file1.gguf\n"
+      "  lm-pull smollm:135m docker://ai/smollm2\n");
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        print_usage();
-        return 1;
-    }
+// Returns 0 to continue, 1 on a usage error and 2 when help was requested
+static int parse_args(int argc, char * argv[], std::vector<std::string> & models) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            return 2;
+        } else if ((arg == "-c" || arg == "--connections") && i + 1 < argc) {
+            options.connections = std::atoi(argv[++i]);
+            if (options.connections < 1) {
+                printe("Invalid connection count: %s\n", argv[i]);
 
-    std::string model = argv[1];
-    if (model == "-h" || model == "--help") {
-        print_usage();
-        return 0;
+                return 1;
+            }
+        } else if (arg == "--max-connections" && i + 1 < argc) {
+            options.conn_budget = std::atol(argv[++i]);
+            if (options.conn_budget < 0) {
+                printe("Invalid connection budget: %s\n", argv[i]);
+
+                return 1;
+            }
+        } else if (arg == "--store" && i + 1 < argc) {
+            options.store = argv[++i];
+        } else if (arg == "--tls-cache") {
+#if LIBCURL_VERSION_NUM >= 0x080c00
+            options.tls_cache = true;
+#else
+            printe("--tls-cache needs libcurl 8.12 or later, ignoring it\n");
+#endif
+        } else if (arg == "--sha256" && i + 1 < argc) {
+            if (sha256_select(argv[++i])) {
+                return 1;
+            }
+        } else if (arg == "--bench-sha256") {
+            options.bench = true;
+        } else if (arg == "--stats") {
+            options.stats = true;
+        } else if (arg == "--io" && i + 1 < argc) {
+            const std::string backend = argv[++i];
+            if (backend != "pwrite" && backend != "io_uring") {
+                printe("Unknown I/O backend: %s\n", backend.c_str());
+
+                return 1;
+            }
+
+            options.io_uring = backend == "io_uring";
+        } else if (arg == "--bench-write") {
+            options.bench_write = true;
+        } else if (arg == "--direct") {
+            options.direct = true;
+        } else if (arg == "--sync" && i + 1 < argc) {
+            const std::string policy = argv[++i];
+            if (policy != "durable" && policy != "fast") {
+                printe("Unknown sync policy: %s\n", policy.c_str());
+
+                return 1;
+            }
+
+            options.durable = policy == "durable";
+        } else if (arg == "--retries" && i + 1 < argc) {
+            options.retries = std::atoi(argv[++i]);
+            if (options.retries < 0) {
+                printe("Invalid retry count: %s\n", argv[i]);
+
+                return 1;
+            }
+        } else if (arg == "--retry-max-time" && i + 1 < argc) {
+            options.retry_time = std::atoi(argv[++i]);
+            if (options.retry_time < 0) {
+                printe("Invalid retry time: %s\n", argv[i]);
+
+                return 1;
+            }
+        } else if (arg == "--speed-limit" && i + 1 < argc) {
+            options.speed_limit = std::atol(argv[++i]);
+            if (options.speed_limit < 0) {
+                printe("Invalid speed limit: %s\n", argv[i]);
+
+                return 1;
+            }
+        } else if (arg == "--speed-time" && i + 1 < argc) {
+            options.speed_time = std::atol(argv[++i]);
+            if (options.speed_time < 1) {
+                printe("Invalid speed time: %s\n", argv[i]);
+
+                return 1;
+            }
+        } else if (arg == "--include" && i + 1 < argc) {
+            options.include.push_back(argv[++i]);
+        } else if (arg == "--exclude" && i + 1 < argc) {
+            options.exclude.push_back(argv[++i]);
+        } else if (arg == "--no-hedge") {
+            options.hedge = false;
+        } else if (arg == "--no-preconnect") {
+            options.preconnect = false;
+        } else if (arg == "--offline") {
+            options.offline = true;
+        } else if (arg == "--mirror" && i + 1 < argc) {
+            const std::string mirror = argv[++i];
+            const size_t      equals = mirror.find('=');
+            const std::string scheme = mirror.substr(0, equals);
+            if (equals == std::string::npos || (scheme != "ollama" && scheme != "docker" && scheme != "hf") ||
+                mirror.find("://", equals) == std::string::npos) {
+                printe("Invalid mirror, expected ollama=, docker= or hf= and a URL: %s\n", mirror.c_str());
+
+                return 1;
+            }
+
+            Mirrors::get().add(scheme, mirror.substr(equals + 1));
+        } else if (!starts_with(arg, "-")) {
+            models.push_back(arg);
+        } else {
+            return 1;
+        }
     }
 
+    return models.empty() && !options.bench && !options.bench_write;
+}
+
+static int pull(std::string model) {
     const std::string              bn      = basename(model);
     const std::vector<std::string> headers = { "--header",
                                                "Accept: application/vnd.docker.distribution.manifest.v2+json" };
 
     int ret = 0;
-    if (starts_with(model, "https://")) {
+    if (starts_with(model, "https://") && options.offline) {
+        // Plain URLs keep no metadata, so offline only a file from an earlier download counts
+        if (!std::filesystem::exists(bn)) {
+            printe("%s has not been downloaded, it cannot be pulled offline\n", bn.c_str());
+            ret = 1;
+        }
+    } else if (starts_with(model, "https://")) {
         ret = download(model, {}, bn, true);
     } else if (starts_with(model, "hf://") || starts_with(model, "huggingface://")) {
         rm_substring(model, "://");
@@ -582,3 +5486,94 @@ int main(int argc, char* argv[]) {
 
     return ret;
 }
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> models;
+    const int                args_ret = parse_args(argc, argv, models);
+    if (args_ret) {
+        print_usage();
+        return args_ret == 2 ? 0 : 1;
+    }
+
+    if (options.bench) {
+        return bench_sha256();
+    }
+
+    if (options.bench_write) {
+        return bench_write();
+    }
+
+    if (options.store.empty()) {
+        options.store = cache_dir();
+    }
+
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    const std::string tls_sessions = cache_dir() + "/tls-sessions";
+    if (options.tls_cache) {
+        CurlShare::get().load_tls_sessions(tls_sessions);
+    }
+
+    const std::string latencies = cache_dir() + "/latencies.json";
+    Latencies::get().load(latencies);
+    const std::string redirects = cache_dir() + "/redirects.json";
+    Preconnect::get().load(redirects);
+    const std::string tokens = cache_dir() + "/docker-tokens.json";
+    Tokens::get().load(tokens);
+
+    // HuggingFace files of one repository are looked up together, in a single paths-info request
+    for (std::string model : models) {
+        if ((starts_with(model, "hf://") || starts_with(model, "huggingface://")) && !rm_substring(model, "://")) {
+            HfMetadata::get().want(model);
+        } else if (starts_with(model, "hf.co/") && !rm_substring(model, "hf.co/")) {
+            HfMetadata::get().want(model);
+        }
+    }
+
+    // Every pull shares the transfer engine; the threads only sequence their own requests
+    int ret = 0;
+    if (models.size() == 1) {
+        ret = pull(models[0]);
+    } else {
+        options.progress = false;
+        std::vector<int>         results(models.size());
+        std::vector<std::thread> pulls;
+        for (size_t i = 0; i < models.size(); ++i) {
+            pulls.emplace_back([&results, &models, i] { results[i] = pull(models[i]); });
+        }
+
+        for (size_t i = 0; i < models.size(); ++i) {
+            pulls[i].join();
+            printe("%s: %s\n", models[i].c_str(), results[i] ? "failed" : "done");
+            ret = ret || results[i];
+        }
+    }
+
+    TransferEngine::get().stop();
+    if (totals.retries > 0 || totals.hedged > 0 || Preconnect::get().connected() > 0) {
+        printe("\n");
+    }
+
+    if (totals.retries > 0) {
+        printe("Retried %d times, resuming saved %.1f MiB\n", totals.retries.load(),
+               static_cast<double>(totals.resumed.load()) / (1 << 20));
+    }
+
+    if (totals.hedged > 0) {
+        printe("Hedged %d slow metadata requests; the hedge answered first in %d\n", totals.hedged.load(),
+               totals.hedge_wins.load());
+    }
+
+    Preconnect::get().report();
+    Latencies::get().save(latencies);
+    Preconnect::get().save(redirects);
+    Tokens::get().save(tokens);
+
+    if (options.tls_cache) {
+        CurlShare::get().save_tls_sessions(tls_sessions);
+    }
+
+    CurlShare::get().close();
+    curl_global_cleanup();
+
+    return ret;
+}